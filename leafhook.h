@@ -5,9 +5,14 @@
  * 
  * Usage:
  * 
- *  - Define `LH_AARCH64` on ARM64, `LH_AARCH32` on ARM32, etc.
+ *  - Define `LH_AARCH64` on ARM64, `LH_AARCH32` on ARM32, `LH_X86_64` on
+ *    x86-64, etc.
  *  - Create a hooker (`LHHookerCreate()`)
  *  - Use it to hook functions (`LHHookerHookFunction()`)
+ *  - Or to count calls to them without writing a hook (`LHHookerInstrument()`)
+ *  - Or to run callbacks around them (`LHHookerWrap()`)
+ *  - Or to send many of them to one handler that finds out which function
+ *    was called from `LHHookerEnterContext()` (`LHHookerHookWithContext()`)
  */
 
 #ifndef _LEAFHOOK_HEADER
@@ -19,17 +24,81 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <time.h>
+
+// Number of buckets in a latency histogram, bucket n counts calls that took
+// [2^n, 2^(n+1)) cycles
+#define LH_HISTOGRAM_BUCKETS 32
+
+typedef struct LHCounters {
+	void *function;   // The instrumented function, set by LHHookerInstrument()
+	bool latency;     // Set before instrumenting to also time calls
+	uint64_t calls;
+	uint64_t cycles;  // Total cycles spent in calls that were timed
+	uint64_t histogram[LH_HISTOGRAM_BUCKETS];
+} LHCounters;
+
+// Called before a wrapped function runs, return true to have `exit` called
+// when this call returns
+typedef bool (*LHWrapEnterFunc)(void *data);
+
+// Called after a wrapped function returns with timestamps from LHReadCycles()
+typedef void (*LHWrapExitFunc)(void *data, uint64_t start, uint64_t end);
+
+// What a handler from LHHookerHookWithContext() gets about the call
+typedef struct LHContext {
+	void *function;  // The hooked function
+	void *orig;      // Calls the original, with the same signature
+	void *user_data;
+} LHContext;
+
+// An extra rwx block mapped close to some data, for x86-64 trampolines that
+// keep rip-relative operands
+typedef struct LHNearBlock {
+	void *base;
+	size_t used;
+} LHNearBlock;
 
 typedef struct LHHooker {
 	void *rwx_block;
 	size_t rwx_block_size;
 	size_t rwx_block_used;
+	LHNearBlock *near_blocks;
+	size_t near_block_count;
+	void *thunk_entry;
+	void *thunk_exit;
+	LHCounters **counters;
+	size_t counter_count;
 } LHHooker;
 
 LHHooker *LHHookerCreate(void);
 void LHHookerRelease(LHHooker *self);
 
 bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **orig);
+bool LHHookerInstrument(LHHooker *self, void *function, LHCounters *counters);
+bool LHHookerWrap(LHHooker *self, void *function, LHWrapEnterFunc enter, LHWrapExitFunc exit, void *data);
+bool LHHookerHookWithContext(LHHooker *self, void *function, void *handler, void *user_data, void **orig);
+LHContext *LHHookerCurrentContext(void);
+LHContext *LHHookerEnterContext(LHContext **caller);
+void LHHookerLeaveContext(LHContext *caller);
+size_t LHHookerSnapshotCounters(LHHooker *self, LHCounters *out, size_t max_count, bool reset);
+void LHHookerResetCounters(LHHooker *self);
+
+// Timestamp counter used to time calls: the TSC on x86-64, the virtual
+// counter on AArch64 and nanoseconds elsewhere
+static inline uint64_t LHReadCycles(void) {
+#if defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t value;
+	__asm__ volatile ("mrs %0, cntvct_el0" : "=r" (value));
+	return value;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
 
 #ifdef LEAFHOOK_IMPLEMENTATION
 
@@ -39,361 +108,2810 @@ bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **ori
 // Get bits to OR to sign extend if negative
 #define LH_SEXT64_NB(nbits) (0xffffffffffffffff - ( (1 << (nbits - 1)) - 1 ))
 
-// Fill the last (64 - nbits) bits with 1's if most significant is 1 or zero if
-// most significant is zero.
-#define LH_SEXT64(input, nbits) (LH_SEXT_ISNEG(input, nbits) ? (LH_SEXT64_NB(nbits) | input) : input)
+// Fill the last (64 - nbits) bits with 1's if most significant is 1 or zero if
+// most significant is zero.
+#define LH_SEXT64(input, nbits) (LH_SEXT_ISNEG(input, nbits) ? (LH_SEXT64_NB(nbits) | input) : input)
+
+// Automatically generated functions for working with ARM instructions
+// AArch64
+
+static inline uint32_t LHMakeAArch64Adr(uint32_t imm, uint32_t Rd) {
+	return (((Rd) & 0x1f) << 0) | ((((imm) >> 2) & 0x7ffff) << 5) | (0b10000 << 24) | (((imm) & 0x3) << 29) | (0b0 << 31);
+}
+
+static inline uint32_t LHDecodeAArch64AdrImm(uint32_t ins) {
+	return ((((ins) >> 29) & 0x3) << 0) | ((((ins) >> 5) & 0x7ffff) << 2);
+}
+
+static inline uint32_t LHDecodeAArch64AdrRd(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Adr(uint32_t ins) {
+	return (ins & 0x9f000000) == 0x10000000;
+}
+
+static inline uint32_t LHMakeAArch64Adrp(uint32_t imm, uint32_t Rd) {
+	return (((Rd) & 0x1f) << 0) | ((((imm) >> 2) & 0x7ffff) << 5) | (0b10000 << 24) | (((imm) & 0x3) << 29) | (0b1 << 31);
+}
+
+static inline uint32_t LHDecodeAArch64AdrpImm(uint32_t ins) {
+	return ((((ins) >> 29) & 0x3) << 0) | ((((ins) >> 5) & 0x7ffff) << 2);
+}
+
+static inline uint32_t LHDecodeAArch64AdrpRd(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Adrp(uint32_t ins) {
+	return (ins & 0x9f000000) == 0x90000000;
+}
+
+static inline uint32_t LHMakeAArch64LoadLiteral(uint32_t opc, uint32_t v, uint32_t imm, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((imm) & 0x7ffff) << 5) | (0b00 << 24) | (((v) & 0x1) << 26) | (0b011 << 27) | (((opc) & 0x3) << 30);
+}
+
+static inline uint32_t LHDecodeAArch64LoadLiteralOpc(uint32_t ins) {
+	return ((((ins) >> 30) & 0x3) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LoadLiteralV(uint32_t ins) {
+	return ((((ins) >> 26) & 0x1) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LoadLiteralImm(uint32_t ins) {
+	return ((((ins) >> 5) & 0x7ffff) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LoadLiteralRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64LoadLiteral(uint32_t ins) {
+	return (ins & 0x3b000000) == 0x18000000;
+}
+
+static inline uint32_t LHMakeAArch64B(uint32_t imm) {
+	return (((imm) & 0x3ffffff) << 0) | (0b000101 << 26);
+}
+
+static inline uint32_t LHDecodeAArch64BImm(uint32_t ins) {
+	return ((((ins) >> 0) & 0x3ffffff) << 0);
+}
+
+static inline bool LHIsAArch64B(uint32_t ins) {
+	return (ins & 0xfc000000) == 0x14000000;
+}
+
+static inline uint32_t LHMakeAArch64Bl(uint32_t imm) {
+	return (((imm) & 0x3ffffff) << 0) | (0b100101 << 26);
+}
+
+static inline uint32_t LHDecodeAArch64BlImm(uint32_t ins) {
+	return ((((ins) >> 0) & 0x3ffffff) << 0);
+}
+
+static inline bool LHIsAArch64Bl(uint32_t ins) {
+	return (ins & 0xfc000000) == 0x94000000;
+}
+
+static inline uint32_t LHMakeAArch64BCond(uint32_t imm, uint32_t cond) {
+	return (((cond) & 0xf) << 0) | (0b0 << 4) | (((imm) & 0x7ffff) << 5) | (0b01010100 << 24);
+}
+
+static inline uint32_t LHDecodeAArch64BCondImm(uint32_t ins) {
+	return ((((ins) >> 5) & 0x7ffff) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64BCondCond(uint32_t ins) {
+	return ((((ins) >> 0) & 0xf) << 0);
+}
+
+static inline bool LHIsAArch64BCond(uint32_t ins) {
+	return (ins & 0xff000010) == 0x54000000;
+}
+
+static inline uint32_t LHMakeAArch64Tbz(uint32_t b5, uint32_t nz, uint32_t b40, uint32_t imm, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((imm) & 0x3fff) << 5) | (((b40) & 0x1f) << 19) | (((nz) & 0x1) << 24) | (0b011011 << 25) | (((b5) & 0x1) << 31);
+}
+
+static inline uint32_t LHDecodeAArch64TbzB5(uint32_t ins) {
+	return ((((ins) >> 31) & 0x1) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64TbzNz(uint32_t ins) {
+	return ((((ins) >> 24) & 0x1) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64TbzB40(uint32_t ins) {
+	return ((((ins) >> 19) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64TbzImm(uint32_t ins) {
+	return ((((ins) >> 5) & 0x3fff) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64TbzRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Tbz(uint32_t ins) {
+	return (ins & 0x7e000000) == 0x36000000;
+}
+
+static inline uint32_t LHMakeAArch64Nop(void) {
+	return (0b11010101000000110010000000011111 << 0);
+}
+
+static inline bool LHIsAArch64Nop(uint32_t ins) {
+	return (ins & 0xffffffff) == 0xd503201f;
+}
+
+static inline uint32_t LHMakeAArch64Br(uint32_t Rn) {
+	return (0b00000 << 0) | (((Rn) & 0x1f) << 5) | (0b1101011000011111000000 << 10);
+}
+
+static inline uint32_t LHDecodeAArch64BrRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Br(uint32_t ins) {
+	return (ins & 0xfffffc1f) == 0xd61f0000;
+}
+
+static inline uint32_t LHMakeAArch64Blr(uint32_t Rn) {
+	return (0b00000 << 0) | (((Rn) & 0x1f) << 5) | (0b1101011000111111000000 << 10);
+}
+
+static inline uint32_t LHDecodeAArch64BlrRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Blr(uint32_t ins) {
+	return (ins & 0xfffffc1f) == 0xd63f0000;
+}
+
+static inline uint32_t LHMakeAArch64Ret(uint32_t Rn) {
+	return (0b00000 << 0) | (((Rn) & 0x1f) << 5) | (0b1101011001011111000000 << 10);
+}
+
+static inline uint32_t LHDecodeAArch64RetRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Ret(uint32_t ins) {
+	return (ins & 0xfffffc1f) == 0xd65f0000;
+}
+
+static inline uint32_t LHMakeAArch64Cbz(uint32_t sf, uint32_t nz, uint32_t imm, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((imm) & 0x7ffff) << 5) | (((nz) & 0x1) << 24) | (0b011010 << 25) | (((sf) & 0x1) << 31);
+}
+
+static inline uint32_t LHDecodeAArch64CbzSf(uint32_t ins) {
+	return ((((ins) >> 31) & 0x1) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64CbzNz(uint32_t ins) {
+	return ((((ins) >> 24) & 0x1) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64CbzImm(uint32_t ins) {
+	return ((((ins) >> 5) & 0x7ffff) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64CbzRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Cbz(uint32_t ins) {
+	return (ins & 0x7e000000) == 0x34000000;
+}
+
+static inline uint32_t LHMakeAArch64Mov(uint32_t Rm, uint32_t Rd) {
+	return (((Rd) & 0x1f) << 0) | (0b00000011111 << 5) | (((Rm) & 0x1f) << 16) | (0b10101010000 << 21);
+}
+
+static inline uint32_t LHDecodeAArch64MovRm(uint32_t ins) {
+	return ((((ins) >> 16) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64MovRd(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Mov(uint32_t ins) {
+	return (ins & 0xffe0ffe0) == 0xaa0003e0;
+}
+
+static inline uint32_t LHMakeAArch64AddImm(uint32_t imm, uint32_t Rn, uint32_t Rd) {
+	return (((Rd) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((imm) & 0xfff) << 10) | (0b1001000100 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64AddImmImm(uint32_t ins) {
+	return ((((ins) >> 10) & 0xfff) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64AddImmRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64AddImmRd(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64AddImm(uint32_t ins) {
+	return (ins & 0xffc00000) == 0x91000000;
+}
+
+static inline uint32_t LHMakeAArch64LdrImm(uint32_t imm, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((imm) & 0xfff) << 10) | (0b1111100101 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64LdrImmImm(uint32_t ins) {
+	return ((((ins) >> 10) & 0xfff) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdrImmRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdrImmRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64LdrImm(uint32_t ins) {
+	return (ins & 0xffc00000) == 0xf9400000;
+}
+
+static inline uint32_t LHMakeAArch64Stp(uint32_t imm, uint32_t Rt2, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((Rt2) & 0x1f) << 10) | (((imm) & 0x7f) << 15) | (0b1010100100 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64StpImm(uint32_t ins) {
+	return ((((ins) >> 15) & 0x7f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpRt2(uint32_t ins) {
+	return ((((ins) >> 10) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Stp(uint32_t ins) {
+	return (ins & 0xffc00000) == 0xa9000000;
+}
+
+static inline uint32_t LHMakeAArch64Ldp(uint32_t imm, uint32_t Rt2, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((Rt2) & 0x1f) << 10) | (((imm) & 0x7f) << 15) | (0b1010100101 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64LdpImm(uint32_t ins) {
+	return ((((ins) >> 15) & 0x7f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpRt2(uint32_t ins) {
+	return ((((ins) >> 10) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Ldp(uint32_t ins) {
+	return (ins & 0xffc00000) == 0xa9400000;
+}
+
+static inline uint32_t LHMakeAArch64StpPre(uint32_t imm, uint32_t Rt2, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((Rt2) & 0x1f) << 10) | (((imm) & 0x7f) << 15) | (0b1010100110 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64StpPreImm(uint32_t ins) {
+	return ((((ins) >> 15) & 0x7f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpPreRt2(uint32_t ins) {
+	return ((((ins) >> 10) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpPreRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpPreRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64StpPre(uint32_t ins) {
+	return (ins & 0xffc00000) == 0xa9800000;
+}
+
+static inline uint32_t LHMakeAArch64LdpPost(uint32_t imm, uint32_t Rt2, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((Rt2) & 0x1f) << 10) | (((imm) & 0x7f) << 15) | (0b1010100011 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64LdpPostImm(uint32_t ins) {
+	return ((((ins) >> 15) & 0x7f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpPostRt2(uint32_t ins) {
+	return ((((ins) >> 10) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpPostRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpPostRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64LdpPost(uint32_t ins) {
+	return (ins & 0xffc00000) == 0xa8c00000;
+}
+
+static inline uint32_t LHMakeAArch64StpQ(uint32_t imm, uint32_t Rt2, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((Rt2) & 0x1f) << 10) | (((imm) & 0x7f) << 15) | (0b1010110100 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64StpQImm(uint32_t ins) {
+	return ((((ins) >> 15) & 0x7f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpQRt2(uint32_t ins) {
+	return ((((ins) >> 10) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpQRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StpQRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64StpQ(uint32_t ins) {
+	return (ins & 0xffc00000) == 0xad000000;
+}
+
+static inline uint32_t LHMakeAArch64LdpQ(uint32_t imm, uint32_t Rt2, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((Rt2) & 0x1f) << 10) | (((imm) & 0x7f) << 15) | (0b1010110101 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64LdpQImm(uint32_t ins) {
+	return ((((ins) >> 15) & 0x7f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpQRt2(uint32_t ins) {
+	return ((((ins) >> 10) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpQRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdpQRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64LdpQ(uint32_t ins) {
+	return (ins & 0xffc00000) == 0xad400000;
+}
+
+static inline uint32_t LHMakeAArch64Ldxr(uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (0b1100100001011111011111 << 10);
+}
+
+static inline uint32_t LHDecodeAArch64LdxrRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64LdxrRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Ldxr(uint32_t ins) {
+	return (ins & 0xfffffc00) == 0xc85f7c00;
+}
+
+static inline uint32_t LHMakeAArch64Stxr(uint32_t Rs, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (0b011111 << 10) | (((Rs) & 0x1f) << 16) | (0b11001000000 << 21);
+}
+
+static inline uint32_t LHDecodeAArch64StxrRs(uint32_t ins) {
+	return ((((ins) >> 16) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StxrRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StxrRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64Stxr(uint32_t ins) {
+	return (ins & 0xffe0fc00) == 0xc8007c00;
+}
+
+static inline uint32_t LHMakeAArch64StrImm(uint32_t imm, uint32_t Rn, uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (((imm) & 0xfff) << 10) | (0b1111100100 << 22);
+}
+
+static inline uint32_t LHDecodeAArch64StrImmImm(uint32_t ins) {
+	return ((((ins) >> 10) & 0xfff) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StrImmRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64StrImmRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64StrImm(uint32_t ins) {
+	return (ins & 0xffc00000) == 0xf9000000;
+}
+
+static inline uint32_t LHMakeAArch64AddReg(uint32_t Rm, uint32_t Rn, uint32_t Rd) {
+	return (((Rd) & 0x1f) << 0) | (((Rn) & 0x1f) << 5) | (0b000000 << 10) | (((Rm) & 0x1f) << 16) | (0b10001011000 << 21);
+}
+
+static inline uint32_t LHDecodeAArch64AddRegRm(uint32_t ins) {
+	return ((((ins) >> 16) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64AddRegRn(uint32_t ins) {
+	return ((((ins) >> 5) & 0x1f) << 0);
+}
+
+static inline uint32_t LHDecodeAArch64AddRegRd(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64AddReg(uint32_t ins) {
+	return (ins & 0xffe0fc00) == 0x8b000000;
+}
+
+static inline uint32_t LHMakeAArch64MrsTpidr(uint32_t Rt) {
+	return (((Rt) & 0x1f) << 0) | (0b110101010011101111010000010 << 5);
+}
+
+static inline uint32_t LHDecodeAArch64MrsTpidrRt(uint32_t ins) {
+	return ((((ins) >> 0) & 0x1f) << 0);
+}
+
+static inline bool LHIsAArch64MrsTpidr(uint32_t ins) {
+	return (ins & 0xffffffe0) == 0xd53bd040;
+}
+
+typedef enum LHAArch64InsClass {
+	LH_AARCH64_INS_UNKNOWN = 0,
+	LH_AARCH64_INS_ADR,
+	LH_AARCH64_INS_ADRP,
+	LH_AARCH64_INS_LOAD_LITERAL,
+	LH_AARCH64_INS_B,
+	LH_AARCH64_INS_BL,
+	LH_AARCH64_INS_B_COND,
+	LH_AARCH64_INS_TBZ,
+	LH_AARCH64_INS_NOP,
+	LH_AARCH64_INS_BR,
+	LH_AARCH64_INS_BLR,
+	LH_AARCH64_INS_RET,
+	LH_AARCH64_INS_CBZ,
+	LH_AARCH64_INS_MOV,
+	LH_AARCH64_INS_ADD_IMM,
+	LH_AARCH64_INS_LDR_IMM,
+	LH_AARCH64_INS_STP,
+	LH_AARCH64_INS_LDP,
+	LH_AARCH64_INS_STP_PRE,
+	LH_AARCH64_INS_LDP_POST,
+	LH_AARCH64_INS_STP_Q,
+	LH_AARCH64_INS_LDP_Q,
+	LH_AARCH64_INS_LDXR,
+	LH_AARCH64_INS_STXR,
+	LH_AARCH64_INS_STR_IMM,
+	LH_AARCH64_INS_ADD_REG,
+	LH_AARCH64_INS_MRS_TPIDR,
+} LHAArch64InsClass;
+
+static inline LHAArch64InsClass LHClassifyAArch64(uint32_t ins) {
+	if (ins & 0x8000000) {
+		if (ins & 0x1000000) {
+			if (ins & 0x400000) {
+				if (ins & 0x40000000) {
+					return (ins & 0xffc00000) == 0xf9400000 ? LH_AARCH64_INS_LDR_IMM : LH_AARCH64_INS_UNKNOWN;
+				}
+				else {
+					if (ins & 0x4000000) {
+						return (ins & 0xffc00000) == 0xad400000 ? LH_AARCH64_INS_LDP_Q : LH_AARCH64_INS_UNKNOWN;
+					}
+					else {
+						return (ins & 0xffc00000) == 0xa9400000 ? LH_AARCH64_INS_LDP : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+			}
+			else {
+				if (ins & 0x40000000) {
+					return (ins & 0xffc00000) == 0xf9000000 ? LH_AARCH64_INS_STR_IMM : LH_AARCH64_INS_UNKNOWN;
+				}
+				else {
+					if (ins & 0x20000000) {
+						if (ins & 0x4000000) {
+							return (ins & 0xffc00000) == 0xad000000 ? LH_AARCH64_INS_STP_Q : LH_AARCH64_INS_UNKNOWN;
+						}
+						else {
+							if (ins & 0x800000) {
+								return (ins & 0xffc00000) == 0xa9800000 ? LH_AARCH64_INS_STP_PRE : LH_AARCH64_INS_UNKNOWN;
+							}
+							else {
+								return (ins & 0xffc00000) == 0xa9000000 ? LH_AARCH64_INS_STP : LH_AARCH64_INS_UNKNOWN;
+							}
+						}
+					}
+					else {
+						return (ins & 0xffe0fc00) == 0x8b000000 ? LH_AARCH64_INS_ADD_REG : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+			}
+		}
+		else {
+			if (ins & 0x20000000) {
+				if (ins & 0x2000000) {
+					return (ins & 0xffe0ffe0) == 0xaa0003e0 ? LH_AARCH64_INS_MOV : LH_AARCH64_INS_UNKNOWN;
+				}
+				else {
+					return (ins & 0xffc00000) == 0xa8c00000 ? LH_AARCH64_INS_LDP_POST : LH_AARCH64_INS_UNKNOWN;
+				}
+			}
+			else {
+				if (ins & 0x10000000) {
+					return (ins & 0x3b000000) == 0x18000000 ? LH_AARCH64_INS_LOAD_LITERAL : LH_AARCH64_INS_UNKNOWN;
+				}
+				else {
+					if (ins & 0x400000) {
+						return (ins & 0xfffffc00) == 0xc85f7c00 ? LH_AARCH64_INS_LDXR : LH_AARCH64_INS_UNKNOWN;
+					}
+					else {
+						return (ins & 0xffe0fc00) == 0xc8007c00 ? LH_AARCH64_INS_STXR : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+			}
+		}
+	}
+	else {
+		if (ins & 0x40000000) {
+			if (ins & 0x2000000) {
+				if (ins & 0x400000) {
+					return (ins & 0xfffffc1f) == 0xd65f0000 ? LH_AARCH64_INS_RET : LH_AARCH64_INS_UNKNOWN;
+				}
+				else {
+					if (ins & 0x200000) {
+						return (ins & 0xfffffc1f) == 0xd63f0000 ? LH_AARCH64_INS_BLR : LH_AARCH64_INS_UNKNOWN;
+					}
+					else {
+						return (ins & 0xfffffc1f) == 0xd61f0000 ? LH_AARCH64_INS_BR : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+			}
+			else {
+				if (ins & 0x80000000) {
+					if (ins & 0x4000000) {
+						if (ins & 0x200000) {
+							return (ins & 0xffffffe0) == 0xd53bd040 ? LH_AARCH64_INS_MRS_TPIDR : LH_AARCH64_INS_UNKNOWN;
+						}
+						else {
+							return (ins & 0xffffffff) == 0xd503201f ? LH_AARCH64_INS_NOP : LH_AARCH64_INS_UNKNOWN;
+						}
+					}
+					else {
+						return (ins & 0x9f000000) == 0x90000000 ? LH_AARCH64_INS_ADRP : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+				else {
+					if (ins & 0x4000000) {
+						return (ins & 0xff000010) == 0x54000000 ? LH_AARCH64_INS_B_COND : LH_AARCH64_INS_UNKNOWN;
+					}
+					else {
+						return (ins & 0x9f000000) == 0x10000000 ? LH_AARCH64_INS_ADR : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+			}
+		}
+		else {
+			if (ins & 0x4000000) {
+				if (ins & 0x20000000) {
+					if (ins & 0x2000000) {
+						return (ins & 0x7e000000) == 0x36000000 ? LH_AARCH64_INS_TBZ : LH_AARCH64_INS_UNKNOWN;
+					}
+					else {
+						return (ins & 0x7e000000) == 0x34000000 ? LH_AARCH64_INS_CBZ : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+				else {
+					if (ins & 0x80000000) {
+						return (ins & 0xfc000000) == 0x94000000 ? LH_AARCH64_INS_BL : LH_AARCH64_INS_UNKNOWN;
+					}
+					else {
+						return (ins & 0xfc000000) == 0x14000000 ? LH_AARCH64_INS_B : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+			}
+			else {
+				if (ins & 0x80000000) {
+					if (ins & 0x1000000) {
+						return (ins & 0xffc00000) == 0x91000000 ? LH_AARCH64_INS_ADD_IMM : LH_AARCH64_INS_UNKNOWN;
+					}
+					else {
+						return (ins & 0x9f000000) == 0x90000000 ? LH_AARCH64_INS_ADRP : LH_AARCH64_INS_UNKNOWN;
+					}
+				}
+				else {
+					return (ins & 0x9f000000) == 0x10000000 ? LH_AARCH64_INS_ADR : LH_AARCH64_INS_UNKNOWN;
+				}
+			}
+		}
+	}
+}
+
+// AArch32
+
+static inline uint32_t LHMakeAArch32Adr(uint32_t Rd, uint32_t imm) {
+	return (((imm) & 0xfff) << 0) | (((Rd) & 0xf) << 12) | (0b1110001010001111 << 16);
+}
+
+static inline uint32_t LHDecodeAArch32AdrRd(uint32_t ins) {
+	return ((((ins) >> 12) & 0xf) << 0);
+}
+
+static inline uint32_t LHDecodeAArch32AdrImm(uint32_t ins) {
+	return ((((ins) >> 0) & 0xfff) << 0);
+}
+
+static inline bool LHIsAArch32Adr(uint32_t ins) {
+	return (ins & 0xffff0000) == 0xe28f0000;
+}
+
+static inline uint32_t LHMakeAArch32AdrSub(uint32_t Rd, uint32_t imm) {
+	return (((imm) & 0xfff) << 0) | (((Rd) & 0xf) << 12) | (0b1110001001001111 << 16);
+}
+
+static inline uint32_t LHDecodeAArch32AdrSubRd(uint32_t ins) {
+	return ((((ins) >> 12) & 0xf) << 0);
+}
+
+static inline uint32_t LHDecodeAArch32AdrSubImm(uint32_t ins) {
+	return ((((ins) >> 0) & 0xfff) << 0);
+}
+
+static inline bool LHIsAArch32AdrSub(uint32_t ins) {
+	return (ins & 0xffff0000) == 0xe24f0000;
+}
+
+static inline uint32_t LHMakeAArch32LdrLiteral(uint32_t U, uint32_t Rt, uint32_t imm) {
+	return (((imm) & 0xfff) << 0) | (((Rt) & 0xf) << 12) | (0b0011111 << 16) | (((U) & 0x1) << 23) | (0b11100101 << 24);
+}
+
+static inline uint32_t LHDecodeAArch32LdrLiteralU(uint32_t ins) {
+	return ((((ins) >> 23) & 0x1) << 0);
+}
+
+static inline uint32_t LHDecodeAArch32LdrLiteralRt(uint32_t ins) {
+	return ((((ins) >> 12) & 0xf) << 0);
+}
+
+static inline uint32_t LHDecodeAArch32LdrLiteralImm(uint32_t ins) {
+	return ((((ins) >> 0) & 0xfff) << 0);
+}
+
+static inline bool LHIsAArch32LdrLiteral(uint32_t ins) {
+	return (ins & 0xff7f0000) == 0xe51f0000;
+}
+
+static inline uint32_t LHMakeAArch32Bx(uint32_t Rm) {
+	return (((Rm) & 0xf) << 0) | (0b1110000100101111111111110001 << 4);
+}
+
+static inline uint32_t LHDecodeAArch32BxRm(uint32_t ins) {
+	return ((((ins) >> 0) & 0xf) << 0);
+}
+
+static inline bool LHIsAArch32Bx(uint32_t ins) {
+	return (ins & 0xfffffff0) == 0xe12fff10;
+}
+
+static inline uint32_t LHMakeAArch32B(uint32_t cond, uint32_t imm) {
+	return (((imm) & 0xffffff) << 0) | (0b1010 << 24) | (((cond) & 0xf) << 28);
+}
+
+static inline uint32_t LHDecodeAArch32BCond(uint32_t ins) {
+	return ((((ins) >> 28) & 0xf) << 0);
+}
+
+static inline uint32_t LHDecodeAArch32BImm(uint32_t ins) {
+	return ((((ins) >> 0) & 0xffffff) << 0);
+}
+
+static inline bool LHIsAArch32B(uint32_t ins) {
+	return (ins & 0xf000000) == 0xa000000;
+}
+
+static inline uint32_t LHMakeAArch32Bl(uint32_t cond, uint32_t imm) {
+	return (((imm) & 0xffffff) << 0) | (0b1011 << 24) | (((cond) & 0xf) << 28);
+}
+
+static inline uint32_t LHDecodeAArch32BlCond(uint32_t ins) {
+	return ((((ins) >> 28) & 0xf) << 0);
+}
+
+static inline uint32_t LHDecodeAArch32BlImm(uint32_t ins) {
+	return ((((ins) >> 0) & 0xffffff) << 0);
+}
+
+static inline bool LHIsAArch32Bl(uint32_t ins) {
+	return (ins & 0xf000000) == 0xb000000;
+}
+
+static inline uint32_t LHMakeAArch32Blx(uint32_t Rm) {
+	return (((Rm) & 0xf) << 0) | (0b1110000100101111111111110011 << 4);
+}
+
+static inline uint32_t LHDecodeAArch32BlxRm(uint32_t ins) {
+	return ((((ins) >> 0) & 0xf) << 0);
+}
+
+static inline bool LHIsAArch32Blx(uint32_t ins) {
+	return (ins & 0xfffffff0) == 0xe12fff30;
+}
+
+typedef enum LHAArch32InsClass {
+	LH_AARCH32_INS_UNKNOWN = 0,
+	LH_AARCH32_INS_ADR,
+	LH_AARCH32_INS_ADR_SUB,
+	LH_AARCH32_INS_LDR_LITERAL,
+	LH_AARCH32_INS_BX,
+	LH_AARCH32_INS_B,
+	LH_AARCH32_INS_BL,
+	LH_AARCH32_INS_BLX,
+} LHAArch32InsClass;
+
+static inline LHAArch32InsClass LHClassifyAArch32(uint32_t ins) {
+	if (ins & 0x2000000) {
+		if (ins & 0x8000000) {
+			if (ins & 0x1000000) {
+				return (ins & 0xf000000) == 0xb000000 ? LH_AARCH32_INS_BL : LH_AARCH32_INS_UNKNOWN;
+			}
+			else {
+				return (ins & 0xf000000) == 0xa000000 ? LH_AARCH32_INS_B : LH_AARCH32_INS_UNKNOWN;
+			}
+		}
+		else {
+			if (ins & 0x800000) {
+				return (ins & 0xffff0000) == 0xe28f0000 ? LH_AARCH32_INS_ADR : LH_AARCH32_INS_UNKNOWN;
+			}
+			else {
+				return (ins & 0xffff0000) == 0xe24f0000 ? LH_AARCH32_INS_ADR_SUB : LH_AARCH32_INS_UNKNOWN;
+			}
+		}
+	}
+	else {
+		if (ins & 0x4000000) {
+			return (ins & 0xff7f0000) == 0xe51f0000 ? LH_AARCH32_INS_LDR_LITERAL : LH_AARCH32_INS_UNKNOWN;
+		}
+		else {
+			if (ins & 0x20) {
+				return (ins & 0xfffffff0) == 0xe12fff30 ? LH_AARCH32_INS_BLX : LH_AARCH32_INS_UNKNOWN;
+			}
+			else {
+				return (ins & 0xfffffff0) == 0xe12fff10 ? LH_AARCH32_INS_BX : LH_AARCH32_INS_UNKNOWN;
+			}
+		}
+	}
+}
+// END AUTO GENERATED FUNCTIONS
+
+void *LHHookerMapRwxPages(size_t size) {
+	return mmap(NULL, size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+LHHooker *LHHookerCreate(void) {
+	/**
+	 * Create a new hook manager
+	 */
+	
+	LHHooker *self = malloc(sizeof *self);
+	
+	if (!self) {
+		return NULL;
+	}
+	
+	memset(self, 0, sizeof *self);
+	
+	self->rwx_block_size = 10 * getpagesize();
+	self->rwx_block = LHHookerMapRwxPages(self->rwx_block_size);
+	
+	if (self->rwx_block == MAP_FAILED) {
+		self->rwx_block = NULL;
+		LHHookerRelease(self);
+		return NULL;
+	}
+	
+	return self;
+}
+
+void LHHookerRelease(LHHooker *self) {
+	/**
+	 * Release a hook manager and any related resources. Don't call if any
+	 * hooked functions might still be used.
+	 */
+	
+	if (!self) {
+		return;
+	}
+	
+	if (self->rwx_block) {
+		munmap(self->rwx_block, self->rwx_block_size);
+	}
+	
+	for (size_t i = 0; i < self->near_block_count; i++) {
+		munmap(self->near_blocks[i].base, self->rwx_block_size);
+	}
+	
+	free(self->near_blocks);
+	free(self->counters);
+	free(self);
+}
+
+#if defined(LH_AARCH64) || defined(LH_AARCH32) || defined(LH_X86_64)
+
+static void *LHHookerAllocRwx(LHHooker *self, size_t size) {
+	/**
+	 * Allocate some RWX memory from self->rwx_block. Should be 4 byte aligned.
+	 */
+	
+	// Ensure 4 byte alignment
+	if (size & 3) {
+		size += 4 - (size & 3);
+	}
+	
+	// Make sure there is enough space left
+	if (self->rwx_block_used + size > self->rwx_block_size) {
+		return NULL;
+	}
+	
+	// Calc pointer
+	void *ptr = self->rwx_block + self->rwx_block_used;
+	
+	// Add this allocation to used size
+	self->rwx_block_used += size;
+	
+	return ptr;
+}
+
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+
+static void *LHHookerNextRwx(LHHooker *self) {
+	/**
+	 * Get the address that the next call to LHHookerAllocRwx() will return,
+	 * for code that needs to know where it will end up before it is copied.
+	 */
+	
+	return self->rwx_block + self->rwx_block_used;
+}
+
+static void LHHookerAlignRwx(LHHooker *self, size_t align) {
+	/**
+	 * Align the next allocation from the rwx block to `align` bytes
+	 */
+	
+	self->rwx_block_used = (self->rwx_block_used + align - 1) & ~(align - 1);
+}
+
+#endif
+
+typedef struct LHStream {
+	uint8_t *data;
+	size_t head;
+	size_t size;
+	bool failed;
+} LHStream;
+
+static void LHStreamInit(LHStream *self) {
+	memset(self, 0, sizeof *self);
+}
+
+static void LHStreamWrite(LHStream *self, size_t size, void *data) {
+	if (self->failed) {
+		return;
+	}
+	
+	// Grow the buffer if needed
+	if (self->head + size > self->size) {
+		size_t new_size = self->size ? self->size : 0x80;
+		
+		while (new_size < self->head + size) {
+			new_size *= 2;
+		}
+		
+		uint8_t *new_data = realloc(self->data, new_size);
+		
+		if (!new_data) {
+			self->failed = true;
+			return;
+		}
+		
+		self->data = new_data;
+		self->size = new_size;
+	}
+	
+	memcpy(self->data + self->head, data, size);
+	self->head += size;
+}
+
+#ifdef LH_X86_64
+static size_t LHStreamWrite8(LHStream *self, uint8_t data) {
+	LHStreamWrite(self, sizeof data, &data);
+	return self->head - sizeof data;
+}
+#endif
+
+static size_t LHStreamWrite32(LHStream *self, uint32_t data) {
+	LHStreamWrite(self, sizeof data, &data);
+	return self->head - sizeof data;
+}
+
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+static size_t LHStreamWrite64(LHStream *self, uint64_t data) {
+	LHStreamWrite(self, sizeof data, &data);
+	return self->head - sizeof data;
+}
+#endif
+
+static size_t LHStreamTell(LHStream *self) {
+	return self->head;
+}
+
+static void LHStreamFree(LHStream *self) {
+	free(self->data);
+	LHStreamInit(self);
+}
+
+static void *LHHookerCopyStreams(LHHooker *self, LHStream *code, LHStream *data) {
+	/**
+	 * Copy code followed by its data to a new allocation from the rwx block
+	 * and free the streams. Returns NULL if either of them failed or there is
+	 * no space left.
+	 */
+	
+	void *new_block = NULL;
+	
+	if (!code->failed && !data->failed) {
+		new_block = LHHookerAllocRwx(self, LHStreamTell(code) + LHStreamTell(data));
+	}
+	
+	if (new_block) {
+		memcpy(new_block, code->data, LHStreamTell(code));
+		memcpy(new_block + LHStreamTell(code), data->data, LHStreamTell(data));
+		__builtin___clear_cache(new_block, new_block + LHStreamTell(code));
+	}
+	
+	LHStreamFree(code);
+	LHStreamFree(data);
+	
+	return new_block;
+}
+
+#define LH_COPY_TO_NEW_BLOCK() return LHHookerCopyStreams(self, &code, &data);
+
+#endif
+
+#ifdef LH_AARCH64
+
+// Maximum number of distinct literals in a rewritten block
+#define LH_AARCH64_MAX_LITERALS 64
+
+typedef struct LHAArch64Literal {
+	uint8_t value[16];
+	size_t size;
+	size_t offset; // Offset in the literal pool, once it has been laid out
+} LHAArch64Literal;
+
+typedef struct LHAArch64Rewriter {
+	LHStream code;
+	uint32_t *base; // Where the rewritten code will be copied to
+	LHAArch64Literal literals[LH_AARCH64_MAX_LITERALS];
+	size_t literal_count;
+	size_t refs[LH_AARCH64_MAX_LITERALS * 2][2]; // code position, literal
+	size_t ref_count;
+	bool failed;
+} LHAArch64Rewriter;
+
+static bool LHAArch64InRange(int64_t from, int64_t to, size_t bits, size_t shift) {
+	/**
+	 * Check if `to` is reachable from `from` with a signed immediate of
+	 * `bits` bits that is scaled by `1 << shift`
+	 */
+	
+	int64_t diff = to - from;
+	int64_t limit = ((int64_t) 1 << (bits - 1)) << shift;
+	
+	return (diff & (((int64_t) 1 << shift) - 1)) == 0 && diff >= -limit && diff < limit;
+}
+
+static int64_t LHAArch64Here(LHAArch64Rewriter *rw) {
+	return (int64_t) rw->base + LHStreamTell(&rw->code);
+}
+
+static void LHAArch64EmitLiteralLoad(LHAArch64Rewriter *rw, uint32_t ins, void *value, size_t size) {
+	/**
+	 * Write a load literal instruction `ins` that loads `value` from the
+	 * literal pool, reusing an existing literal if there is one with the same
+	 * value.
+	 */
+	
+	size_t index;
+	
+	for (index = 0; index < rw->literal_count; index++) {
+		LHAArch64Literal *lit = &rw->literals[index];
+		
+		if (lit->size == size && !memcmp(lit->value, value, size)) {
+			break;
+		}
+	}
+	
+	if (index == rw->literal_count) {
+		if (rw->literal_count == LH_AARCH64_MAX_LITERALS) {
+			rw->failed = true;
+			return;
+		}
+		
+		LHAArch64Literal *lit = &rw->literals[rw->literal_count++];
+		memcpy(lit->value, value, size);
+		lit->size = size;
+	}
+	
+	if (rw->ref_count == LH_AARCH64_MAX_LITERALS * 2) {
+		rw->failed = true;
+		return;
+	}
+	
+	rw->refs[rw->ref_count][0] = LHStreamWrite32(&rw->code, ins);
+	rw->refs[rw->ref_count][1] = index;
+	rw->ref_count++;
+}
+
+static void LHAArch64EmitLoadAddress(LHAArch64Rewriter *rw, uint32_t Rd, uint64_t address) {
+	/**
+	 * Write the shortest thing that loads `address` into Rd: an adr, an
+	 * adrp + add or a load from the literal pool.
+	 */
+	
+	int64_t here = LHAArch64Here(rw);
+	
+	// Loading into xzr does nothing, and add would take 31 to mean sp
+	if (Rd == 31) {
+		LHStreamWrite32(&rw->code, LHMakeAArch64Nop());
+	}
+	else if (LHAArch64InRange(here, address, 21, 0)) {
+		LHStreamWrite32(&rw->code, LHMakeAArch64Adr((int64_t) (address - here), Rd));
+	}
+	else if (LHAArch64InRange(here & ~0xfff, address & ~0xfff, 21, 12)) {
+		LHStreamWrite32(&rw->code, LHMakeAArch64Adrp(((address & ~0xfff) - (here & ~0xfff)) >> 12, Rd));
+		
+		if (address & 0xfff) {
+			LHStreamWrite32(&rw->code, LHMakeAArch64AddImm(address & 0xfff, Rd, Rd));
+		}
+	}
+	else {
+		LHAArch64EmitLiteralLoad(rw, LHMakeAArch64LoadLiteral(1, 0, 0, Rd), &address, sizeof address);
+	}
+}
+
+static void LHAArch64EmitBranch(LHAArch64Rewriter *rw, uint64_t target, bool link) {
+	/**
+	 * Write a b or bl to `target`, going through x16 if it is out of range.
+	 */
+	
+	int64_t here = LHAArch64Here(rw);
+	
+	if (LHAArch64InRange(here, target, 26, 2)) {
+		int64_t imm = (int64_t) (target - here) >> 2;
+		LHStreamWrite32(&rw->code, link ? LHMakeAArch64Bl(imm) : LHMakeAArch64B(imm));
+	}
+	else {
+		LHAArch64EmitLiteralLoad(rw, LHMakeAArch64LoadLiteral(1, 0, 0, 16), &target, sizeof target);
+		LHStreamWrite32(&rw->code, link ? LHMakeAArch64Blr(16) : LHMakeAArch64Br(16));
+	}
+}
+
+static void LHRewriteAArch64Ins(LHAArch64Rewriter *rw, uint32_t *old_ins) {
+	/**
+	 * Write a version of the instruction at `old_ins` that does the same thing
+	 * from the new location.
+	 */
+	
+	uint32_t ins = *old_ins;
+	int64_t pc = (int64_t) old_ins;
+	int64_t here = LHAArch64Here(rw);
+	
+	switch (LHClassifyAArch64(ins)) {
+		case LH_AARCH64_INS_ADR: {
+			int64_t imm = LH_SEXT64(LHDecodeAArch64AdrImm(ins), 21);
+			LHAArch64EmitLoadAddress(rw, LHDecodeAArch64AdrRd(ins), pc + imm);
+			break;
+		}
+		case LH_AARCH64_INS_ADRP: {
+			// similar to adr but works with respect to pages
+			int64_t imm = LH_SEXT64(LHDecodeAArch64AdrpImm(ins), 21) << 12;
+			LHAArch64EmitLoadAddress(rw, LHDecodeAArch64AdrpRd(ins), (pc & ~0xfff) + imm);
+			break;
+		}
+		case LH_AARCH64_INS_LOAD_LITERAL: {
+			// ldr/ldrsw/prfm (literal) for general and simd registers
+			uint32_t opc = LHDecodeAArch64LoadLiteralOpc(ins);
+			uint32_t v = LHDecodeAArch64LoadLiteralV(ins);
+			int64_t imm = LH_SEXT64(LHDecodeAArch64LoadLiteralImm(ins), 19) << 2;
+			uint64_t address = pc + imm;
+			
+			if (LHAArch64InRange(here, address, 19, 2)) {
+				// still reachable, keep loading from the original location
+				LHStreamWrite32(&rw->code, (ins & ~(0x7ffff << 5)) | ((((address - here) >> 2) & 0x7ffff) << 5));
+			}
+			else if (opc == 3 && !v) {
+				// prefetching a copy would be pointless
+				LHStreamWrite32(&rw->code, LHMakeAArch64Nop());
+			}
+			else {
+				size_t size = v ? (4 << opc) : (opc == 1 ? 8 : 4);
+				LHAArch64EmitLiteralLoad(rw, ins & ~(0x7ffff << 5), (void *) address, size);
+			}
+			
+			break;
+		}
+		case LH_AARCH64_INS_B: {
+			int64_t imm = LH_SEXT64(LHDecodeAArch64BImm(ins), 26) << 2;
+			LHAArch64EmitBranch(rw, pc + imm, false);
+			break;
+		}
+		case LH_AARCH64_INS_BL: {
+			int64_t imm = LH_SEXT64(LHDecodeAArch64BlImm(ins), 26) << 2;
+			LHAArch64EmitBranch(rw, pc + imm, true);
+			break;
+		}
+		case LH_AARCH64_INS_B_COND:
+		case LH_AARCH64_INS_CBZ:
+		case LH_AARCH64_INS_TBZ: {
+			// Conditional branches: re-encode if the target is still in range,
+			// otherwise invert the condition to skip over a long branch
+			bool cond = LHIsAArch64BCond(ins);
+			size_t bits = LHIsAArch64Tbz(ins) ? 14 : 19;
+			uint32_t mask = ((1 << bits) - 1) << 5;
+			int64_t imm = LH_SEXT64((int64_t) ((ins & mask) >> 5), bits) << 2;
+			uint64_t target = pc + imm;
+			
+			if (LHAArch64InRange(here, target, bits, 2)) {
+				LHStreamWrite32(&rw->code, (ins & ~mask) | ((((target - here) >> 2) << 5) & mask));
+				break;
+			}
+			
+			if (cond && LHDecodeAArch64BCondCond(ins) >= 0xe) {
+				// always
+			}
+			else if (cond) {
+				LHStreamWrite32(&rw->code, LHMakeAArch64BCond(3, LHDecodeAArch64BCondCond(ins) ^ 1));
+			}
+			else {
+				// cbz <-> cbnz and tbz <-> tbnz are bit 24
+				LHStreamWrite32(&rw->code, ((ins & ~mask) ^ (1 << 24)) | (3 << 5));
+			}
+			
+			LHAArch64EmitLiteralLoad(rw, LHMakeAArch64LoadLiteral(1, 0, 0, 16), &target, sizeof target);
+			LHStreamWrite32(&rw->code, LHMakeAArch64Br(16));
+			break;
+		}
+		default: {
+			LHStreamWrite32(&rw->code, ins);
+			break;
+		}
+	}
+}
+
+static uint32_t *LHRewriteAArch64Block(LHHooker *self, uint32_t *old_block, size_t block_size) {
+	/**
+	 * Rewrite a block of instructions located at `old_block` to be position
+	 * indepedent, also inserting a jump back to (old_block + block_size) at the
+	 * end.
+	 */
+	
+	LHHookerAlignRwx(self, 16);
+	
+	LHAArch64Rewriter *rw = malloc(sizeof *rw);
+	
+	if (!rw) {
+		return NULL;
+	}
+	
+	memset(rw, 0, sizeof *rw);
+	rw->base = LHHookerNextRwx(self);
+	
+	for (size_t i = 0; i < block_size; i++) {
+		LHRewriteAArch64Ins(rw, &old_block[i]);
+	}
+	
+	// Insert jump back to end
+	// TODO: Actually figure out which registers are available to use instead of
+	// just using x16
+	LHAArch64EmitBranch(rw, (uint64_t) (old_block + block_size), false);
+	
+	// Lay out the literal pool after the code, biggest literals first so
+	// that they are all naturally aligned
+	LHStream data; LHStreamInit(&data);
+	
+	while (rw->literal_count && (LHStreamTell(&rw->code) & 0xf)) {
+		LHStreamWrite32(&rw->code, LHMakeAArch64Nop());
+	}
+	
+	for (size_t size = 16; size >= 4; size /= 2) {
+		for (size_t i = 0; i < rw->literal_count; i++) {
+			LHAArch64Literal *lit = &rw->literals[i];
+			
+			if (lit->size == size) {
+				lit->offset = LHStreamTell(&data);
+				LHStreamWrite(&data, lit->size, lit->value);
+			}
+		}
+	}
+	
+	// Point the loads at their literals
+	for (size_t i = 0; i < rw->ref_count && !rw->code.failed; i++) {
+		size_t pos = rw->refs[i][0];
+		size_t target = LHStreamTell(&rw->code) + rw->literals[rw->refs[i][1]].offset;
+		uint32_t *ins = (uint32_t *) (rw->code.data + pos);
+		
+		*ins |= ((((target - pos) >> 2) & 0x7ffff) << 5);
+	}
+	
+	LHStream code = rw->code;
+	bool failed = rw->failed;
+	
+	free(rw);
+	
+	if (failed) {
+		LHStreamFree(&code);
+		LHStreamFree(&data);
+		return NULL;
+	}
+	
+	// Copy to rwx block
+	LH_COPY_TO_NEW_BLOCK();
+}
+
+static void LHWriteAArch64LongJump(uint32_t *code, void *target) {
+	code[0] = LHMakeAArch64LoadLiteral(1, 0, 8 >> 2, 16);
+	code[1] = LHMakeAArch64Br(16);
+	memcpy(code + 2, &target, sizeof target);
+}
+
+static bool LHHookerAArch64Function(LHHooker *self, uint32_t *function, uint32_t *hook, uint32_t **orig) {
+	// Only one instruction needs to be replaced if a b can reach the hook
+	bool near = LHAArch64InRange((int64_t) function, (int64_t) hook, 26, 2);
+	size_t block_size = near ? 1 : 4;
+	
+	if (orig) {
+		uint32_t *orig_ptr = LHRewriteAArch64Block(self, function, block_size);
+		
+		if (!orig_ptr) {
+			return false;
+		}
+		
+		orig[0] = orig_ptr;
+	}
+	
+	if (near) {
+		function[0] = LHMakeAArch64B(hook - function);
+	}
+	else {
+		LHWriteAArch64LongJump(function, hook);
+	}
+	
+	__builtin___clear_cache((void *) function, (void *) (function + block_size));
+	
+	return true;
+}
+
+#endif // LH_AARCH64
+
+#ifdef LH_AARCH32
+
+// AArch32, so the PC points to (instruction + 8) for regular arm modea
+#define LH_INS_OFFSET ((code_size * sizeof(uint32_t)) - LHStreamTell(&code) + LHStreamTell(&data) - 8)
+#define LH_PC_VALUE_ALIGNED ((((uint32_t)(uintptr_t)&old_block[i]) + 8) & 0xfffffffc)
+
+static uint32_t LHAArch32ExpandImm(uint32_t imm) {
+	/**
+	 * Decode an ARM modified immediate: an 8 bit value rotated right by twice
+	 * the top 4 bits.
+	 */
+	
+	uint32_t value = imm & 0xff;
+	uint32_t rotate = (imm >> 8) * 2;
+	
+	return rotate ? (value >> rotate) | (value << (32 - rotate)) : value;
+}
+
+uint32_t *LHRewriteAArch32Block(LHHooker *self, uint32_t *old_block, size_t block_size) {
+	/**
+	 * Rewrite a block of asm so that it is position indepedent (for our
+	 * purposes) and has a jump back to the old block at the end.
+	 */
+	
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	
+	// Literals go after the code, so count the code first: one word for each
+	// instruction, two for calls and two for the jump back
+	size_t code_size = block_size + 2;
+	
+	for (size_t i = 0; i < block_size; i++) {
+		LHAArch32InsClass type = LHClassifyAArch32(old_block[i]);
+		
+		if (type == LH_AARCH32_INS_BL || (type == LH_AARCH32_INS_B && LHDecodeAArch32BCond(old_block[i]) == 0xf)) {
+			code_size++;
+		}
+	}
+	
+	for (size_t i = 0; i < block_size; i++) {
+		uint32_t ins = old_block[i];
+		
+		switch (LHClassifyAArch32(ins)) {
+			case LH_AARCH32_INS_ADR:
+			case LH_AARCH32_INS_ADR_SUB: {
+				uint32_t Rd = LHDecodeAArch32AdrRd(ins);
+				uint32_t imm = LHAArch32ExpandImm(LHDecodeAArch32AdrImm(ins));
+				
+				uint32_t result = LH_PC_VALUE_ALIGNED;
+				
+				if (LHIsAArch32Adr(ins)) {
+					result += imm;
+				}
+				else {
+					result -= imm;
+				}
+				
+				LHStreamWrite32(&code, LHMakeAArch32LdrLiteral(1, Rd, LH_INS_OFFSET));
+				LHStreamWrite32(&data, result);
+				break;
+			}
+			case LH_AARCH32_INS_LDR_LITERAL: {
+				bool U = LHDecodeAArch32LdrLiteralU(ins);
+				uint32_t Rt = LHDecodeAArch32LdrLiteralRt(ins);
+				uint32_t imm = LHDecodeAArch32LdrLiteralImm(ins);
+				
+				uint32_t addr = LH_PC_VALUE_ALIGNED;
+				
+				if (U) {
+					addr += imm;
+				}
+				else {
+					addr -= imm;
+				}
+				
+				uint32_t offset = LH_INS_OFFSET;
+				
+				LHStreamWrite32(&code, LHMakeAArch32LdrLiteral(1, Rt, offset));
+				LHStreamWrite32(&data, ((uint32_t *)(uintptr_t)addr)[0]);
+				break;
+			}
+			case LH_AARCH32_INS_B:
+			case LH_AARCH32_INS_BL: {
+				uint32_t cond = LHDecodeAArch32BCond(ins);
+				int32_t imm = (int32_t) (LHDecodeAArch32BImm(ins) << 8) >> 6;
+				uint32_t target = ((uint32_t)(uintptr_t)&old_block[i]) + 8 + imm;
+				
+				if (cond == 0xf) {
+					// 0b1111 is blx, which is always taken and switches to
+					// thumb, with bit 24 giving the halfword
+					target = (target + ((ins >> 23) & 2)) | 1;
+					
+					LHStreamWrite32(&code, LHMakeAArch32LdrLiteral(1, 12, LH_INS_OFFSET));
+					LHStreamWrite32(&code, LHMakeAArch32Blx(12));
+				}
+				else if (LHIsAArch32Bl(ins)) {
+					// ldr ip and blx ip with the same condition as the bl
+					LHStreamWrite32(&code, (LHMakeAArch32LdrLiteral(1, 12, LH_INS_OFFSET) & 0x0fffffff) | (cond << 28));
+					LHStreamWrite32(&code, (LHMakeAArch32Blx(12) & 0x0fffffff) | (cond << 28));
+				}
+				else {
+					// ldr pc with the same condition as the branch
+					LHStreamWrite32(&code, (LHMakeAArch32LdrLiteral(1, 15, LH_INS_OFFSET) & 0x0fffffff) | (cond << 28));
+				}
+				
+				LHStreamWrite32(&data, target);
+				break;
+			}
+			default: {
+				LHStreamWrite32(&code, ins);
+				break;
+			}
+		}
+	}
+	
+	// Insert jump back to rest of function
+	LHStreamWrite32(&code, LHMakeAArch32LdrLiteral(1, 12, LH_INS_OFFSET));
+	LHStreamWrite32(&code, LHMakeAArch32Bx(12));
+	LHStreamWrite32(&data, (uint32_t)(uintptr_t)(old_block + block_size));
+	
+	// Copy to rwx block
+	LH_COPY_TO_NEW_BLOCK();
+}
+
+void LHWriteAArch32LongJump(uint32_t *code, void *target) {
+	code[0] = LHMakeAArch32LdrLiteral(1, 12, 0);
+	code[1] = LHMakeAArch32Bx(12);
+	code[2] = (uint32_t)(uintptr_t)target;
+}
+
+static bool LHHookerAArch32Function(LHHooker *self, uint32_t *function, uint32_t *hook, uint32_t **orig) {
+	if (orig) {
+		uint32_t *orig_ptr = LHRewriteAArch32Block(self, function, 3);
+		
+		if (!orig_ptr) {
+			return false;
+		}
+		
+		orig[0] = orig_ptr;
+	}
+	
+	LHWriteAArch32LongJump(function, hook);
+	
+	return true;
+}
+
+#undef LH_PC_VALUE_ALIGNED
+#undef LH_INS_OFFSET
+
+#endif
+
+#ifdef LH_X86_64
+
+// Maximum number of literals a rewritten x86-64 block can refer to
+#define LH_X86_MAX_FIXUPS 16
+
+typedef struct LHX86Insn {
+	uint8_t length;     // Total length, zero if the instruction couldn't be decoded
+	uint8_t map;        // Opcode map: 0 = one byte, 1 = 0f, 2 = 0f38, 3 = 0f3a
+	uint8_t opcode;     // Last opcode byte
+	uint8_t opcode_pos; // Offset of the opcode byte
+	uint8_t rex;        // REX prefix or zero if there was none
+	uint8_t rip_disp;   // Offset of the disp32 of a rip-relative operand or zero
+	uint8_t rel_size;   // Size of a relative branch displacement or zero
+} LHX86Insn;
+
+// Bitmaps of which one byte and 0f opcodes are followed by a ModRM byte
+static const uint32_t LH_X86_MODRM_1BYTE[8] = {
+	0x0f0f0f0f, 0x0f0f0f0f, 0x00000000, 0x00000a08,
+	0x0000ffff, 0x00000000, 0xff0f00c3, 0xc0c00000,
+};
+
+static const uint32_t LH_X86_MODRM_0F[8] = {
+	0xffffa00f, 0x0000ffff, 0xffffffff, 0xff7fffff,
+	0xffff0000, 0xfffff8f8, 0xffff00ff, 0xffffffff,
+};
+
+#define LH_X86_BIT_SET(map, op) (((map)[(op) >> 5] >> ((op) & 31)) & 1)
+
+static size_t LHX86ImmSize(uint8_t map, uint8_t op, uint8_t modrm, bool opsize, bool adsize, bool rex_w) {
+	/**
+	 * Get the size of the immediate (including relative branch displacements)
+	 * that follows an instruction's opcode and operands.
+	 */
+	
+	size_t z = opsize ? 2 : 4;
+	
+	if (map == 3) {
+		return 1;
+	}
+	
+	if (map == 1) {
+		switch (op) {
+			case 0x0f: case 0x70: case 0x71: case 0x72: case 0x73:
+			case 0xa4: case 0xac: case 0xba: case 0xc2: case 0xc4:
+			case 0xc5: case 0xc6:
+				return 1;
+			default:
+				return (op >= 0x80 && op <= 0x8f) ? 4 : 0;
+		}
+	}
+	
+	if (map == 2) {
+		return 0;
+	}
+	
+	if (op < 0x40) {
+		// ALU ops with al/eax, the ModRM forms take no immediate
+		return ((op & 7) == 4) ? 1 : ((op & 7) == 5) ? z : 0;
+	}
+	
+	if ((op >= 0x70 && op <= 0x7f) || (op >= 0xb0 && op <= 0xb7) || (op >= 0xe0 && op <= 0xe7)) {
+		return 1;
+	}
+	
+	if (op >= 0xb8 && op <= 0xbf) {
+		return rex_w ? 8 : z;
+	}
+	
+	if (op >= 0xa0 && op <= 0xa3) {
+		return adsize ? 4 : 8;
+	}
+	
+	switch (op) {
+		case 0x6a: case 0x6b: case 0x80: case 0x83: case 0xa8:
+		case 0xc0: case 0xc1: case 0xc6: case 0xcd: case 0xeb:
+			return 1;
+		case 0x68: case 0x69: case 0x81: case 0xa9: case 0xc7:
+			return z;
+		case 0xe8: case 0xe9:
+			return 4;
+		case 0xc2: case 0xca:
+			return 2;
+		case 0xc8:
+			return 3;
+		case 0xf6:
+			return (((modrm >> 3) & 7) < 2) ? 1 : 0;
+		case 0xf7:
+			return (((modrm >> 3) & 7) < 2) ? z : 0;
+		default:
+			return 0;
+	}
+}
+
+static bool LHX86Decode(const uint8_t *code, LHX86Insn *insn) {
+	/**
+	 * Find the length of the x86-64 instruction at `code` and where any
+	 * position dependent parts of it are. Returns false if it is not an
+	 * instruction we know how to handle.
+	 */
+	
+	const uint8_t *p = code;
+	bool opsize = false, adsize = false, rex_w = false, has_modrm;
+	uint8_t map = 0, op;
+	
+	memset(insn, 0, sizeof *insn);
+	
+	// Legacy prefixes
+	for (size_t i = 0; i < 14; i++, p++) {
+		if (*p == 0x66) {
+			opsize = true;
+		}
+		else if (*p == 0x67) {
+			adsize = true;
+		}
+		else if (*p != 0xf0 && *p != 0xf2 && *p != 0xf3 && *p != 0x2e && *p != 0x36 && *p != 0x3e && *p != 0x26 && *p != 0x64 && *p != 0x65) {
+			break;
+		}
+	}
+	
+	// REX has to come right before the opcode
+	if ((*p & 0xf0) == 0x40) {
+		insn->rex = *p;
+		rex_w = (*p & 0x8) != 0;
+		p++;
+	}
+	
+	if (*p == 0xc4 || *p == 0xc5 || *p == 0x62) {
+		// VEX and EVEX, always have a ModRM except for vzeroupper/vzeroall
+		if (*p == 0xc5) {
+			map = 1;
+			p += 2;
+		}
+		else if (*p == 0xc4) {
+			map = p[1] & 0x1f;
+			rex_w = (p[2] & 0x80) != 0;
+			p += 3;
+		}
+		else {
+			map = p[1] & 0x7;
+			rex_w = (p[2] & 0x80) != 0;
+			p += 4;
+		}
+		
+		if (map < 1 || map > 3) {
+			return false;
+		}
+		
+		insn->opcode_pos = p - code;
+		op = *p++;
+		has_modrm = !(map == 1 && op == 0x77);
+	}
+	else {
+		if (*p == 0x0f) {
+			p++;
+			map = 1;
+			
+			if (*p == 0x38) {
+				p++;
+				map = 2;
+			}
+			else if (*p == 0x3a) {
+				p++;
+				map = 3;
+			}
+		}
+		
+		insn->opcode_pos = p - code;
+		op = *p++;
+		
+		if (map == 0) {
+			has_modrm = LH_X86_BIT_SET(LH_X86_MODRM_1BYTE, op);
+			
+			// Not valid in 64 bit mode
+			if (op == 0x06 || op == 0x07 || op == 0x0e || op == 0x16 || op == 0x17 || op == 0x1e || op == 0x1f || op == 0x27 || op == 0x2f || op == 0x37 || op == 0x3f || op == 0x60 || op == 0x61 || op == 0x82 || op == 0x9a || op == 0xce || op == 0xd4 || op == 0xd5 || op == 0xd6 || op == 0xea) {
+				return false;
+			}
+		}
+		else if (map == 1) {
+			has_modrm = LH_X86_BIT_SET(LH_X86_MODRM_0F, op);
+		}
+		else {
+			has_modrm = true;
+		}
+	}
+	
+	insn->map = map;
+	insn->opcode = op;
+	
+	uint8_t modrm = 0;
+	
+	if (has_modrm) {
+		modrm = *p++;
+		uint8_t mod = modrm >> 6, rm = modrm & 7;
+		
+		if (mod != 3) {
+			if (rm == 4) {
+				uint8_t sib = *p++;
+				
+				if (mod == 0 && (sib & 7) == 5) {
+					p += 4;
+				}
+			}
+			else if (mod == 0 && rm == 5) {
+				insn->rip_disp = p - code;
+				p += 4;
+			}
+			
+			if (mod == 1) {
+				p += 1;
+			}
+			else if (mod == 2) {
+				p += 4;
+			}
+		}
+	}
+	
+	size_t imm_size = LHX86ImmSize(map, op, modrm, opsize, adsize, rex_w);
+	
+	// Relative branches, they are always at the end of the instruction
+	if ((map == 0 && ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3) || op == 0xe8 || op == 0xe9 || op == 0xeb)) || (map == 1 && op >= 0x80 && op <= 0x8f)) {
+		insn->rel_size = imm_size;
+	}
+	
+	p += imm_size;
+	
+	if (p - code > 15) {
+		return false;
+	}
+	
+	insn->length = p - code;
+	
+	return true;
+}
+
+static bool LHX86InRel32(intptr_t from, intptr_t to) {
+	/**
+	 * Check if `to` can be reached using a rel32 relative to `from`
+	 */
+	
+	intptr_t diff = to - from;
+	return diff >= INT32_MIN && diff <= INT32_MAX;
+}
+
+typedef struct LHX86Rewriter {
+	LHStream code;
+	LHStream data;
+	uint8_t *base; // Where the rewritten code will be copied to
+	size_t fixups[LH_X86_MAX_FIXUPS][3]; // disp32 pos, insn end pos, data pos
+	size_t fixup_count;
+	uint64_t far_data; // Data a rip-relative operand couldn't reach, or zero
+} LHX86Rewriter;
+
+static bool LHX86EmitLiteralRef(LHX86Rewriter *rw, uint64_t value) {
+	/**
+	 * Write a disp32 that will refer to a new 64-bit literal once the code has
+	 * been finished, must be the last thing in the instruction.
+	 */
+	
+	if (rw->fixup_count == LH_X86_MAX_FIXUPS) {
+		return false;
+	}
+	
+	size_t *fixup = rw->fixups[rw->fixup_count++];
+	fixup[0] = LHStreamWrite32(&rw->code, 0);
+	fixup[1] = LHStreamTell(&rw->code);
+	fixup[2] = LHStreamWrite64(&rw->data, value);
+	
+	return true;
+}
+
+static bool LHX86EmitJump(LHX86Rewriter *rw, uint64_t target, bool call) {
+	/**
+	 * Write a jmp or call to an absolute address, using rel32 when it is in
+	 * range and an indirect jump through a literal otherwise.
+	 */
+	
+	intptr_t next = (intptr_t) rw->base + LHStreamTell(&rw->code) + 5;
+	
+	if (LHX86InRel32(next, target)) {
+		LHStreamWrite8(&rw->code, call ? 0xe8 : 0xe9);
+		LHStreamWrite32(&rw->code, (uint32_t) (target - next));
+		return true;
+	}
+	
+	// jmp/call qword ptr [rip + disp32]
+	LHStreamWrite8(&rw->code, 0xff);
+	LHStreamWrite8(&rw->code, call ? 0x15 : 0x25);
+	return LHX86EmitLiteralRef(rw, target);
+}
+
+static bool LHRewriteX86Insn(LHX86Rewriter *rw, uint8_t *ins, LHX86Insn *info) {
+	/**
+	 * Write a position independent version of the instruction at `ins` to
+	 * the rewriter's code stream.
+	 */
+	
+	uint8_t *next = ins + info->length;
+	
+	if (info->rel_size) {
+		// Relative branches: work out the real target and branch to it using
+		// something that can reach it from the new location
+		intptr_t disp = (info->rel_size == 1) ? (int8_t) next[-1] : (int32_t) (next[-4] | (next[-3] << 8) | (next[-2] << 16) | ((uint32_t) next[-1] << 24));
+		uint64_t target = (uint64_t) (next + disp);
+		uint8_t op = info->opcode;
+		
+		if (info->map == 0 && (op == 0xe9 || op == 0xeb)) {
+			return LHX86EmitJump(rw, target, false);
+		}
+		else if (info->map == 0 && op == 0xe8) {
+			return LHX86EmitJump(rw, target, true);
+		}
+		
+		size_t skip;
+		
+		if (info->map == 0 && op >= 0xe0 && op <= 0xe3) {
+			// loop/jrcxz: keep the short branch but point it at a long jump
+			// that gets skipped over if it isn't taken
+			LHStreamWrite(&rw->code, info->opcode_pos, ins);
+			LHStreamWrite8(&rw->code, op);
+			LHStreamWrite8(&rw->code, 2);
+			LHStreamWrite8(&rw->code, 0xeb);
+			skip = LHStreamWrite8(&rw->code, 0);
+		}
+		else {
+			// jcc: invert the condition to skip over a long jump
+			LHStreamWrite8(&rw->code, 0x70 | ((op & 0xf) ^ 1));
+			skip = LHStreamWrite8(&rw->code, 0);
+		}
+		
+		if (!LHX86EmitJump(rw, target, false) || rw->code.failed) {
+			return false;
+		}
+		
+		rw->code.data[skip] = LHStreamTell(&rw->code) - (skip + 1);
+	}
+	else if (info->rip_disp) {
+		// rip-relative operand: fix up the displacement if the new location
+		// is still in range
+		uint8_t *disp_ptr = ins + info->rip_disp;
+		int32_t disp = (int32_t) (disp_ptr[0] | (disp_ptr[1] << 8) | (disp_ptr[2] << 16) | ((uint32_t) disp_ptr[3] << 24));
+		uint64_t target = (uint64_t) (next + disp);
+		intptr_t new_next = (intptr_t) rw->base + LHStreamTell(&rw->code) + info->length;
+		
+		if (LHX86InRel32(new_next, target)) {
+			size_t start = LHStreamTell(&rw->code);
+			LHStreamWrite(&rw->code, info->length, ins);
+			
+			if (rw->code.failed) {
+				return false;
+			}
+			
+			uint32_t new_disp = (uint32_t) (target - new_next);
+			memcpy(rw->code.data + start + info->rip_disp, &new_disp, sizeof new_disp);
+		}
+		else if (info->map == 0 && info->opcode == 0x8d && (info->rex & 0x8)) {
+			// lea r64, [rip + disp] -> mov r64, imm64
+			LHStreamWrite8(&rw->code, 0x48 | ((info->rex & 0x4) >> 2));
+			LHStreamWrite8(&rw->code, 0xb8 | ((ins[info->opcode_pos + 1] >> 3) & 7));
+			LHStreamWrite64(&rw->code, target);
+		}
+		else {
+			// can't reach the data anymore, the caller can try again from a
+			// block closer to it
+			rw->far_data = target;
+			return false;
+		}
+	}
+	else {
+		LHStreamWrite(&rw->code, info->length, ins);
+	}
+	
+	return true;
+}
+
+static uint8_t *LHRewriteX86Block(LHHooker *self, uint8_t *old_block, size_t min_size, size_t *block_size, uint64_t *far_data) {
+	/**
+	 * Rewrite at least `min_size` bytes of whole instructions located at
+	 * `old_block` to be position independent, also inserting a jump back to
+	 * the instruction after the last one copied. The number of bytes that were
+	 * actually covered is written to `block_size`. If it failed because a
+	 * rip-relative operand is out of range, its target is written to
+	 * `far_data`.
+	 */
+	
+	LHX86Rewriter rw;
+	LHStreamInit(&rw.code);
+	LHStreamInit(&rw.data);
+	rw.base = LHHookerNextRwx(self);
+	rw.fixup_count = 0;
+	rw.far_data = 0;
+	
+	size_t pos = 0;
+	bool ok = true;
+	
+	while (ok && pos < min_size) {
+		LHX86Insn info;
+		
+		ok = LHX86Decode(old_block + pos, &info) && LHRewriteX86Insn(&rw, old_block + pos, &info);
+		pos += info.length;
+	}
+	
+	// Insert jump back to the rest of the function
+	ok = ok && LHX86EmitJump(&rw, (uint64_t) (old_block + pos), false);
+	
+	if (!ok || rw.code.failed) {
+		LHStreamFree(&rw.code);
+		LHStreamFree(&rw.data);
+		far_data[0] = rw.far_data;
+		return NULL;
+	}
+	
+	// Point literal references at the data that follows the code
+	for (size_t i = 0; i < rw.fixup_count; i++) {
+		uint32_t disp = (uint32_t) (LHStreamTell(&rw.code) - rw.fixups[i][1] + rw.fixups[i][2]);
+		memcpy(rw.code.data + rw.fixups[i][0], &disp, sizeof disp);
+	}
+	
+	block_size[0] = pos;
+	
+	// Copy to rwx block
+	return LHHookerCopyStreams(self, &rw.code, &rw.data);
+}
+
+static size_t LHWriteX86Jump(uint8_t *code, void *target) {
+	/**
+	 * Write a jump to `target` at `code`, returns the number of bytes written
+	 * which is 5 for a rel32 jump and 14 for an absolute one.
+	 */
+	
+	if (LHX86InRel32((intptr_t) code + 5, (intptr_t) target)) {
+		uint32_t disp = (uint32_t) ((intptr_t) target - ((intptr_t) code + 5));
+		code[0] = 0xe9;
+		memcpy(code + 1, &disp, sizeof disp);
+		return 5;
+	}
+	
+	// jmp qword ptr [rip + 0]; dq target
+	code[0] = 0xff;
+	code[1] = 0x25;
+	memset(code + 2, 0, 4);
+	memcpy(code + 6, &target, sizeof target);
+	return 14;
+}
+
+// Largest trampoline that a near block needs to have space for
+#define LH_X86_MAX_TRAMPOLINE 256
+
+static LHNearBlock *LHHookerNearBlock(LHHooker *self, uint64_t target) {
+	/**
+	 * Find or map an rwx block that rip-relative operands in it can use to
+	 * reach `target` from anywhere in the block. New blocks are the same size
+	 * as the main one and are searched for in 1 MiB steps going out from
+	 * `target`.
+	 */
+	
+	size_t size = self->rwx_block_size;
+	
+	for (size_t i = 0; i < self->near_block_count; i++) {
+		LHNearBlock *block = &self->near_blocks[i];
+		intptr_t base = (intptr_t) block->base;
+		
+		if (LHX86InRel32(base, target) && LHX86InRel32(base + size, target) && block->used + LH_X86_MAX_TRAMPOLINE <= size) {
+			return block;
+		}
+	}
+	
+	LHNearBlock *new_blocks = realloc(self->near_blocks, (self->near_block_count + 1) * sizeof *new_blocks);
+	
+	if (!new_blocks) {
+		return NULL;
+	}
+	
+	self->near_blocks = new_blocks;
+	
+	const uint64_t step = 1 << 20;
+	uint64_t start = target & ~(step - 1);
+
+#ifdef MAP_FIXED_NOREPLACE
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE;
+#else
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#endif
+
+	for (uint64_t dist = step; dist + size < INT32_MAX; dist += step) {
+		for (int dir = 0; dir < 2; dir++) {
+			if (!dir && start < dist + step) {
+				continue;
+			}
+			
+			uint64_t hint = dir ? start + dist : start - dist;
+			void *base = mmap((void *) hint, size, PROT_EXEC | PROT_READ | PROT_WRITE, flags, -1, 0);
+			
+			if (base == MAP_FAILED) {
+				continue;
+			}
+			
+			// Without MAP_FIXED_NOREPLACE the kernel may put it elsewhere
+			if (!LHX86InRel32((intptr_t) base, target) || !LHX86InRel32((intptr_t) base + size, target)) {
+				munmap(base, size);
+				continue;
+			}
+			
+			LHNearBlock *block = &self->near_blocks[self->near_block_count++];
+			block->base = base;
+			block->used = 0;
+			
+			return block;
+		}
+	}
+	
+	return NULL;
+}
+
+static void LHHookerSwapRwx(LHHooker *self, LHNearBlock *block) {
+	/**
+	 * Make allocations come from `block` instead of the current rwx block,
+	 * calling it again switches back
+	 */
+	
+	void *base = self->rwx_block;
+	size_t used = self->rwx_block_used;
+	
+	self->rwx_block = block->base;
+	self->rwx_block_used = block->used;
+	block->base = base;
+	block->used = used;
+}
+
+static bool LHHookerX86Function(LHHooker *self, uint8_t *function, uint8_t *hook, uint8_t **orig) {
+	size_t jump_size = LHX86InRel32((intptr_t) function + 5, (intptr_t) hook) ? 5 : 14;
+	size_t covered = jump_size;
+	
+	if (orig) {
+		uint64_t far_data = 0;
+		uint8_t *orig_ptr = LHRewriteX86Block(self, function, jump_size, &covered, &far_data);
+		
+		if (!orig_ptr && far_data) {
+			// The rwx block is too far from data the function uses (like it
+			// would be from a PIE executable's), so put this trampoline in a
+			// block that is close to it
+			LHNearBlock *block = LHHookerNearBlock(self, far_data);
+			
+			if (block) {
+				LHHookerSwapRwx(self, block);
+				orig_ptr = LHRewriteX86Block(self, function, jump_size, &covered, &far_data);
+				LHHookerSwapRwx(self, block);
+			}
+		}
+		
+		if (!orig_ptr) {
+			return false;
+		}
+		
+		orig[0] = orig_ptr;
+	}
+	else {
+		// Still need to know where the last overwritten instruction ends
+		for (covered = 0; covered < jump_size;) {
+			LHX86Insn info;
+			
+			if (!LHX86Decode(function + covered, &info)) {
+				return false;
+			}
+			
+			covered += info.length;
+		}
+	}
+	
+	size_t written = LHWriteX86Jump(function, hook);
+	
+	// int3 out whatever is left of the last instruction
+	memset(function + written, 0xcc, covered - written);
+	
+	return true;
+}
+
+#endif // LH_X86_64
+
+bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **orig) {
+	/**
+	 * Hook the function pointed to by `function` to call `hook`. Optionally
+	 * write a pointer to where the original function can be invoked at `orig`,
+	 * if it is not null.
+	 */
+	
+	bool success = false;
+#ifdef LH_AARCH64
+	success = LHHookerAArch64Function(self, function, hook, (uint32_t **) orig);
+#elif defined(LH_AARCH32)
+	success = LHHookerAArch32Function(self, function, hook, (uint32_t **) orig);
+#elif defined(LH_X86_64)
+	success = LHHookerX86Function(self, function, hook, (uint8_t **) orig);
+#endif
+	return success;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Instrumentation
+//////////////////
+
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+
+// Number of nested timed calls a thread can have before we stop timing them
+#define LH_SHADOW_STACK_SIZE 256
+
+typedef struct LHThunk LHThunk;
+
+struct LHThunk {
+	void *orig;                    // Relocated prologue, must stay first
+	void *exit_stub;               // Where timed calls return to
+	LHWrapEnterFunc enter;         // Return true to also time this call
+	LHWrapExitFunc exit;
+	void *data;
+};
+
+typedef struct LHShadowFrame {
+	void *ret;
+	LHThunk *thunk;
+	uint64_t start;
+} LHShadowFrame;
+
+// Real return addresses of calls that are being timed
+static __thread LHShadowFrame gLHShadowStack[LH_SHADOW_STACK_SIZE];
+static __thread size_t gLHShadowDepth;
+
+// Where context thunks leave the context of the call they were entered for
+// and the one it replaced, which the handler keeps to put back
+typedef struct LHContextSlot {
+	LHContext *current;
+	LHContext *caller;
+} LHContextSlot;
+
+// Initial exec so it is at a fixed offset from the thread pointer that thunks
+// can store to
+__attribute__((tls_model("initial-exec"))) static __thread LHContextSlot gLHContext;
+
+static bool LHContextSlotOffset(intptr_t *offset) {
+	/**
+	 * Get the offset of gLHContext from the thread pointer, which is the
+	 * same in every thread
+	 */
+	
+	uintptr_t tp;
+
+#if defined(__x86_64__)
+	__asm__ ("mov %%fs:0, %0" : "=r" (tp));
+#elif defined(__aarch64__)
+	__asm__ ("mrs %0, tpidr_el0" : "=r" (tp));
+#else
+	return false;
+#endif
+
+	*offset = (intptr_t) ((uintptr_t) &gLHContext - tp);
+	
+	return true;
+}
+
+static void *LHThunkEnter(LHThunk *thunk, void *ret) {
+	/**
+	 * Called from the shared entry stub with the arguments saved, returns the
+	 * address that the original function should return to.
+	 */
+	
+	if (!thunk->enter(thunk->data) || gLHShadowDepth == LH_SHADOW_STACK_SIZE) {
+		return ret;
+	}
+	
+	LHShadowFrame *frame = &gLHShadowStack[gLHShadowDepth++];
+	frame->ret = ret;
+	frame->thunk = thunk;
+	frame->start = LHReadCycles();
+	
+	return thunk->exit_stub;
+}
+
+static void *LHThunkExit(void) {
+	/**
+	 * Called from the shared exit stub with the return value saved, returns
+	 * where the original function was really supposed to return to.
+	 */
+	
+	uint64_t end = LHReadCycles();
+	LHShadowFrame *frame = &gLHShadowStack[--gLHShadowDepth];
+	
+	frame->thunk->exit(frame->thunk->data, frame->start, end);
+	
+	return frame->ret;
+}
+
+static LHThunk *LHHookerAllocThunk(LHHooker *self) {
+	/**
+	 * Allocate a zeroed thunk record from the rwx block, aligned so the stubs
+	 * can load pointers from it.
+	 */
+	
+	LHHookerAlignRwx(self, 8);
+	
+	LHThunk *thunk = LHHookerAllocRwx(self, sizeof *thunk);
+	
+	if (thunk) {
+		memset(thunk, 0, sizeof *thunk);
+	}
+	
+	return thunk;
+}
+
+#ifdef LH_X86_64
+
+static void *LHHookerMakeX86Stubs(LHHooker *self) {
+	/**
+	 * Make the code shared by all thunks that calls LHThunkEnter() and
+	 * LHThunkExit() while preserving the argument and return registers.
+	 */
+	
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	
+	// entry: r11 = thunk, [rsp] = return address
+	static const uint8_t save_args[] = {
+		0x57, 0x56, 0x52, 0x51,             // push rdi, rsi, rdx, rcx
+		0x41, 0x50, 0x41, 0x51, 0x50,       // push r8, r9, rax
+		0x41, 0x52, 0x41, 0x53,             // push r10, r11
+		0x48, 0x81, 0xec, 0x80, 0, 0, 0,    // sub rsp, 0x80
+	};
+	
+	static const uint8_t call_enter[] = {
+		0x4c, 0x89, 0xdf,                   // mov rdi, r11
+		0x48, 0x8b, 0xb4, 0x24, 0xc8, 0, 0, 0, // mov rsi, [rsp + 0xc8]
+		0xff, 0x15, 0x02, 0, 0, 0,          // call [rip + 2] -> LHThunkEnter
+		0xeb, 0x08,                         // jmp over the address
+	};
+	
+	static const uint8_t restore_args[] = {
+		0x48, 0x89, 0x84, 0x24, 0xc8, 0, 0, 0, // mov [rsp + 0xc8], rax
+		0x48, 0x81, 0xc4, 0x80, 0, 0, 0,    // add rsp, 0x80
+		0x41, 0x5b, 0x41, 0x5a,             // pop r11, r10
+		0x58, 0x41, 0x59, 0x41, 0x58,       // pop rax, r9, r8
+		0x59, 0x5a, 0x5e, 0x5f,             // pop rcx, rdx, rsi, rdi
+		0x41, 0xff, 0x23,                   // jmp [r11] -> thunk->orig
+	};
+	
+	LHStreamWrite(&code, sizeof save_args, (void *) save_args);
+	
+	for (uint8_t i = 0; i < 8; i++) {
+		// movdqu [rsp + i * 16], xmm<i>
+		uint8_t movdqu[] = {0xf3, 0x0f, 0x7f, 0x44 | (i << 3), 0x24, i * 16};
+		LHStreamWrite(&code, sizeof movdqu, movdqu);
+	}
+	
+	LHStreamWrite(&code, sizeof call_enter, (void *) call_enter);
+	LHStreamWrite64(&code, (uint64_t) &LHThunkEnter);
+	
+	for (uint8_t i = 0; i < 8; i++) {
+		// movdqu xmm<i>, [rsp + i * 16]
+		uint8_t movdqu[] = {0xf3, 0x0f, 0x6f, 0x44 | (i << 3), 0x24, i * 16};
+		LHStreamWrite(&code, sizeof movdqu, movdqu);
+	}
+	
+	LHStreamWrite(&code, sizeof restore_args, (void *) restore_args);
+	
+	size_t exit_offset = LHStreamTell(&code);
+	
+	// exit: the original function just returned here. long double results
+	// are in st0 and st1, and the exit callback may use the whole x87 stack,
+	// so all of it is saved (which also empties it) and put back.
+	static const uint8_t exit_stub[] = {
+		0x50, 0x52,                         // push rax, rdx
+		0x48, 0x81, 0xec, 0x90, 0, 0, 0,    // sub rsp, 0x90
+		0xf3, 0x0f, 0x7f, 0x04, 0x24,       // movdqu [rsp], xmm0
+		0xf3, 0x0f, 0x7f, 0x4c, 0x24, 0x10, // movdqu [rsp + 0x10], xmm1
+		0xdd, 0x74, 0x24, 0x20,             // fnsave [rsp + 0x20]
+		0xff, 0x15, 0x1e, 0, 0, 0,          // call [rip + 0x1e] -> LHThunkExit
+		0x49, 0x89, 0xc3,                   // mov r11, rax
+		0xdd, 0x64, 0x24, 0x20,             // frstor [rsp + 0x20]
+		0xf3, 0x0f, 0x6f, 0x04, 0x24,       // movdqu xmm0, [rsp]
+		0xf3, 0x0f, 0x6f, 0x4c, 0x24, 0x10, // movdqu xmm1, [rsp + 0x10]
+		0x48, 0x81, 0xc4, 0x90, 0, 0, 0,    // add rsp, 0x90
+		0x5a, 0x58,                         // pop rdx, rax
+		0x41, 0xff, 0xe3,                   // jmp r11
+	};
+	
+	LHStreamWrite(&code, sizeof exit_stub, (void *) exit_stub);
+	LHStreamWrite64(&code, (uint64_t) &LHThunkExit);
+	
+	uint8_t *stubs = LHHookerCopyStreams(self, &code, &data);
+	
+	if (!stubs) {
+		return NULL;
+	}
+	
+	self->thunk_entry = stubs;
+	self->thunk_exit = stubs + exit_offset;
+	
+	return stubs;
+}
+
+static void *LHHookerMakeX86Thunk(LHHooker *self, LHThunk *thunk) {
+	/**
+	 * Make the per function code for a thunk, which loads the thunk into r11
+	 * and goes to the shared entry stub.
+	 */
+	
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	
+	// movabs r11, thunk
+	LHStreamWrite8(&code, 0x49);
+	LHStreamWrite8(&code, 0xbb);
+	LHStreamWrite64(&code, (uint64_t) thunk);
+	
+	// jmp [rip + 0]
+	LHStreamWrite8(&code, 0xff);
+	LHStreamWrite8(&code, 0x25);
+	LHStreamWrite32(&code, 0);
+	LHStreamWrite64(&code, (uint64_t) self->thunk_entry);
+	
+	LH_COPY_TO_NEW_BLOCK();
+}
+
+static void *LHHookerMakeX86CountThunk(LHHooker *self, uint64_t *counter, void ***orig) {
+	/**
+	 * Make a thunk that only counts calls, `orig` is set to where the address
+	 * of the original function needs to be written to.
+	 */
+	
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	
+	// movabs r11, counter
+	LHStreamWrite8(&code, 0x49);
+	LHStreamWrite8(&code, 0xbb);
+	LHStreamWrite64(&code, (uint64_t) counter);
+	
+	// lock inc qword ptr [r11]
+	LHStreamWrite32(&code, 0x03ff49f0);
+	
+	// jmp [rip + 0]
+	LHStreamWrite8(&code, 0xff);
+	LHStreamWrite8(&code, 0x25);
+	LHStreamWrite32(&code, 0);
+	size_t orig_offset = LHStreamWrite64(&code, 0);
+	
+	void *new_block = LHHookerCopyStreams(self, &code, &data);
+	
+	if (!new_block) {
+		return NULL;
+	}
+	
+	orig[0] = new_block + orig_offset;
+	
+	return new_block;
+}
+
+static void *LHHookerMakeX86ContextThunk(LHHooker *self, LHContext *context, void *handler, intptr_t slot) {
+	/**
+	 * Make a thunk that moves the current context in the thread's context
+	 * slot to the caller field, stores `context` and goes to `handler` with
+	 * the arguments untouched
+	 */
+	
+	if (slot != (int32_t) slot || slot + 8 != (int32_t) (slot + 8)) {
+		return NULL;
+	}
+	
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	
+	// mov r11, fs:[slot]
+	LHStreamWrite8(&code, 0x64);
+	LHStreamWrite8(&code, 0x4c);
+	LHStreamWrite8(&code, 0x8b);
+	LHStreamWrite8(&code, 0x1c);
+	LHStreamWrite8(&code, 0x25);
+	LHStreamWrite32(&code, (uint32_t) slot);
+	
+	// mov fs:[slot + 8], r11
+	LHStreamWrite8(&code, 0x64);
+	LHStreamWrite8(&code, 0x4c);
+	LHStreamWrite8(&code, 0x89);
+	LHStreamWrite8(&code, 0x1c);
+	LHStreamWrite8(&code, 0x25);
+	LHStreamWrite32(&code, (uint32_t) (slot + 8));
+	
+	// movabs r11, context
+	LHStreamWrite8(&code, 0x49);
+	LHStreamWrite8(&code, 0xbb);
+	LHStreamWrite64(&code, (uint64_t) context);
+	
+	// mov fs:[slot], r11
+	LHStreamWrite8(&code, 0x64);
+	LHStreamWrite8(&code, 0x4c);
+	LHStreamWrite8(&code, 0x89);
+	LHStreamWrite8(&code, 0x1c);
+	LHStreamWrite8(&code, 0x25);
+	LHStreamWrite32(&code, (uint32_t) slot);
+	
+	// jmp [rip + 0]
+	LHStreamWrite8(&code, 0xff);
+	LHStreamWrite8(&code, 0x25);
+	LHStreamWrite32(&code, 0);
+	LHStreamWrite64(&code, (uint64_t) handler);
+	
+	LH_COPY_TO_NEW_BLOCK();
+}
+
+#endif // LH_X86_64
 
-// Automatically generated macros for working with ARM instructions
-#define MAKE_AARCH64_ADR(imm, Rd) ((((Rd) & 0x1f) << 0) | (((imm >> 2) & 0x7ffff) << 5) | (0b10000 << 24) | (((imm) & 0x3) << 29) | (0b0 << 31))
-#define AARCH64_ADR_DECODE_IMM(input) ((((input >> 29) & 0x3) << 0) | (((input >> 5) & 0x7ffff) << 2))
-#define AARCH64_ADR_DECODE_RD(input) ((((input >> 0) & 0x1f) << 0))
-#define IS_AARCH64_ADR(input) ((input & 0x9f000000) == 0x10000000)
-#define MAKE_AARCH64_ADRP(imm, Rd) ((((Rd) & 0x1f) << 0) | (((imm >> 2) & 0x7ffff) << 5) | (0b10000 << 24) | (((imm) & 0x3) << 29) | (0b1 << 31))
-#define AARCH64_ADRP_DECODE_IMM(input) ((((input >> 29) & 0x3) << 0) | (((input >> 5) & 0x7ffff) << 2))
-#define AARCH64_ADRP_DECODE_RD(input) ((((input >> 0) & 0x1f) << 0))
-#define IS_AARCH64_ADRP(input) ((input & 0x9f000000) == 0x90000000)
-#define MAKE_AARCH64_LDR_LITERAL(x, imm, Rt) ((((Rt) & 0x1f) << 0) | (((imm) & 0x7ffff) << 5) | (0b011000 << 24) | (((x) & 0x1) << 30) | (0b0 << 31))
-#define AARCH64_LDR_LITERAL_DECODE_X(input) ((((input >> 30) & 0x1) << 0))
-#define AARCH64_LDR_LITERAL_DECODE_IMM(input) ((((input >> 5) & 0x7ffff) << 0))
-#define AARCH64_LDR_LITERAL_DECODE_RT(input) ((((input >> 0) & 0x1f) << 0))
-#define IS_AARCH64_LDR_LITERAL(input) ((input & 0xbf000000) == 0x18000000)
-#define MAKE_AARCH64_BR(Rn) ((0b00000 << 0) | (((Rn) & 0x1f) << 5) | (0b1101011000011111000000 << 10))
-#define AARCH64_BR_DECODE_RN(input) ((((input >> 5) & 0x1f) << 0))
-#define IS_AARCH64_BR(input) ((input & 0xfffffc1f) == 0xd61f0000)
-#define MAKE_AARCH32_ADR(Rd, imm) ((((imm) & 0xfff) << 0) | (((Rd) & 0xf) << 12) | (0b1110001010001111 << 16))
-#define AARCH32_ADR_DECODE_RD(input) ((((input >> 12) & 0xf) << 0))
-#define AARCH32_ADR_DECODE_IMM(input) ((((input >> 0) & 0xfff) << 0))
-#define IS_AARCH32_ADR(input) ((input & 0xffff0000) == 0xe28f0000)
-#define MAKE_AARCH32_ADR_SUB(Rd, imm) ((((imm) & 0xfff) << 0) | (((Rd) & 0xf) << 12) | (0b1110001010001111 << 16))
-#define AARCH32_ADR_SUB_DECODE_RD(input) ((((input >> 12) & 0xf) << 0))
-#define AARCH32_ADR_SUB_DECODE_IMM(input) ((((input >> 0) & 0xfff) << 0))
-#define IS_AARCH32_ADR_SUB(input) ((input & 0xffff0000) == 0xe28f0000)
-#define MAKE_AARCH32_LDR_LITERAL(U, Rt, imm) ((((imm) & 0xfff) << 0) | (((Rt) & 0xf) << 12) | (0b0011111 << 16) | (((U) & 0x1) << 23) | (0b11100101 << 24))
-#define AARCH32_LDR_LITERAL_DECODE_U(input) ((((input >> 23) & 0x1) << 0))
-#define AARCH32_LDR_LITERAL_DECODE_RT(input) ((((input >> 12) & 0xf) << 0))
-#define AARCH32_LDR_LITERAL_DECODE_IMM(input) ((((input >> 0) & 0xfff) << 0))
-#define IS_AARCH32_LDR_LITERAL(input) ((input & 0xff7f0000) == 0xe51f0000)
-#define MAKE_AARCH32_BX(Rm) ((((Rm) & 0xf) << 0) | (0b1110000100101111111111110001 << 4))
-#define AARCH32_BX_DECODE_RM(input) ((((input >> 0) & 0xf) << 0))
-#define IS_AARCH32_BX(input) ((input & 0xfffffff0) == 0xe12fff10)
-// END AUTO GENERATED MACROS
+#ifdef LH_AARCH64
 
-void *LHHookerMapRwxPages(size_t size) {
-	return mmap(NULL, size, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-}
+// Offset from the current instruction to the next literal in a sequence of
+// `count` instructions
+#define LH_LIT_OFFSET(count) ((((count) * sizeof(uint32_t)) - LHStreamTell(&code) + LHStreamTell(&data)) >> 2)
 
-LHHooker *LHHookerCreate(void) {
+static void *LHHookerMakeAArch64Stubs(LHHooker *self) {
 	/**
-	 * Create a new hook manager
+	 * Make the code shared by all thunks that calls LHThunkEnter() and
+	 * LHThunkExit() while preserving the argument and return registers.
 	 */
 	
-	LHHooker *self = malloc(sizeof *self);
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
 	
-	if (!self) {
-		return NULL;
+	// entry: x16 = thunk, x30 = return address
+	const size_t count = 40;
+	
+	LHStreamWrite32(&code, LHMakeAArch64StpPre(-28, 30, 31, 29));
+	LHStreamWrite32(&code, LHMakeAArch64AddImm(0, 31, 29));
+	
+	for (uint32_t i = 0; i < 8; i += 2) {
+		LHStreamWrite32(&code, LHMakeAArch64Stp(2 + i, i + 1, 31, i));
 	}
 	
-	memset(self, 0, sizeof *self);
+	LHStreamWrite32(&code, LHMakeAArch64Stp(10, 16, 31, 8));
 	
-	self->rwx_block_size = 10 * getpagesize();
-	self->rwx_block = LHHookerMapRwxPages(self->rwx_block_size);
+	for (uint32_t i = 0; i < 8; i += 2) {
+		LHStreamWrite32(&code, LHMakeAArch64StpQ(6 + i, i + 1, 31, i));
+	}
 	
-	if (!self->rwx_block) {
-		LHHookerRelease(self);
+	LHStreamWrite32(&code, LHMakeAArch64Mov(16, 0));
+	LHStreamWrite32(&code, LHMakeAArch64Mov(30, 1));
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(count), 17));
+	LHStreamWrite64(&data, (uint64_t) &LHThunkEnter);
+	LHStreamWrite32(&code, LHMakeAArch64Blr(17));
+	LHStreamWrite32(&code, LHMakeAArch64Mov(0, 17));
+	
+	for (uint32_t i = 0; i < 8; i += 2) {
+		LHStreamWrite32(&code, LHMakeAArch64LdpQ(6 + i, i + 1, 31, i));
+	}
+	
+	for (uint32_t i = 0; i < 8; i += 2) {
+		LHStreamWrite32(&code, LHMakeAArch64Ldp(2 + i, i + 1, 31, i));
+	}
+	
+	LHStreamWrite32(&code, LHMakeAArch64Ldp(10, 16, 31, 8));
+	LHStreamWrite32(&code, LHMakeAArch64LdpPost(28, 30, 31, 29));
+	LHStreamWrite32(&code, LHMakeAArch64Mov(17, 30));
+	LHStreamWrite32(&code, LHMakeAArch64LdrImm(0, 16, 16));
+	LHStreamWrite32(&code, LHMakeAArch64Br(16));
+	
+	// exit: the original function just returned here
+	size_t exit_offset = LHStreamTell(&code);
+	
+	LHStreamWrite32(&code, LHMakeAArch64StpPre(-10, 1, 31, 0));
+	LHStreamWrite32(&code, LHMakeAArch64StpQ(1, 1, 31, 0));
+	LHStreamWrite32(&code, LHMakeAArch64StpQ(3, 3, 31, 2));
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(count), 17));
+	LHStreamWrite64(&data, (uint64_t) &LHThunkExit);
+	LHStreamWrite32(&code, LHMakeAArch64Blr(17));
+	LHStreamWrite32(&code, LHMakeAArch64Mov(0, 16));
+	LHStreamWrite32(&code, LHMakeAArch64LdpQ(3, 3, 31, 2));
+	LHStreamWrite32(&code, LHMakeAArch64LdpQ(1, 1, 31, 0));
+	LHStreamWrite32(&code, LHMakeAArch64LdpPost(10, 1, 31, 0));
+	LHStreamWrite32(&code, LHMakeAArch64Mov(16, 30));
+	LHStreamWrite32(&code, LHMakeAArch64Ret(30));
+	
+	LHHookerAlignRwx(self, 8);
+	uint8_t *stubs = LHHookerCopyStreams(self, &code, &data);
+	
+	if (!stubs) {
 		return NULL;
 	}
 	
-	return self;
+	self->thunk_entry = stubs;
+	self->thunk_exit = stubs + exit_offset;
+	
+	return stubs;
 }
 
-void LHHookerRelease(LHHooker *self) {
+static void *LHHookerMakeAArch64Thunk(LHHooker *self, LHThunk *thunk) {
 	/**
-	 * Release a hook manager and any related resources. Don't call if any
-	 * hooked functions might still be used.
+	 * Make the per function code for a thunk, which loads the thunk into x16
+	 * and goes to the shared entry stub.
 	 */
 	
-	if (!self) {
-		return;
-	}
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
 	
-	if (self->rwx_block) {
-		munmap(self->rwx_block, self->rwx_block_size);
-	}
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(4), 16));
+	LHStreamWrite64(&data, (uint64_t) thunk);
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(4), 17));
+	LHStreamWrite64(&data, (uint64_t) self->thunk_entry);
+	LHStreamWrite32(&code, LHMakeAArch64Br(17));
+	LHStreamWrite32(&code, 0xd503201f); // nop, keeps the literals aligned
 	
-	free(self);
+	LHHookerAlignRwx(self, 8);
+	LH_COPY_TO_NEW_BLOCK();
 }
 
-static void *LHHookerAllocRwx(LHHooker *self, size_t size) {
+static void *LHHookerMakeAArch64CountThunk(LHHooker *self, uint64_t *counter, void ***orig) {
 	/**
-	 * Allocate some RWX memory from self->rwx_block. Should be 4 byte aligned.
+	 * Make a thunk that only counts calls, `orig` is set to where the address
+	 * of the original function needs to be written to.
 	 */
 	
-	// Ensure 4 byte alignment
-	if (size & 3) {
-		size += 4 - (size & 3);
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(10), 16));
+	LHStreamWrite64(&data, (uint64_t) counter);
+	LHStreamWrite32(&code, LHMakeAArch64StpPre(-2, 1, 31, 0));
+	LHStreamWrite32(&code, LHMakeAArch64Ldxr(16, 0));
+	LHStreamWrite32(&code, LHMakeAArch64AddImm(1, 0, 0));
+	LHStreamWrite32(&code, LHMakeAArch64Stxr(1, 16, 0));
+	LHStreamWrite32(&code, LHMakeAArch64Cbz(0, 1, -3, 1));
+	LHStreamWrite32(&code, LHMakeAArch64LdpPost(2, 1, 31, 0));
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(10), 16));
+	size_t orig_offset = LHStreamWrite64(&data, 0);
+	LHStreamWrite32(&code, LHMakeAArch64Br(16));
+	LHStreamWrite32(&code, 0xd503201f); // nop, keeps the literals aligned
+	
+	LHHookerAlignRwx(self, 8);
+	size_t code_size = LHStreamTell(&code);
+	void *new_block = LHHookerCopyStreams(self, &code, &data);
+	
+	if (!new_block) {
+		return NULL;
 	}
 	
-	// Calc pointer
-	void *ptr = self->rwx_block + self->rwx_block_used;
+	orig[0] = new_block + code_size + orig_offset;
 	
-	// Add this allocation to used size
-	self->rwx_block_used += size;
+	return new_block;
+}
+
+static void *LHHookerMakeAArch64ContextThunk(LHHooker *self, LHContext *context, void *handler, intptr_t slot) {
+	/**
+	 * Make a thunk that moves the current context in the thread's context
+	 * slot to the caller field, stores `context` and goes to `handler` with
+	 * the arguments untouched. Only uses x16 and x17, which calls are allowed
+	 * to clobber.
+	 */
 	
-	return ptr;
+	LHStream code; LHStreamInit(&code);
+	LHStream data; LHStreamInit(&data);
+	
+	LHStreamWrite32(&code, LHMakeAArch64MrsTpidr(17));
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(10), 16));
+	LHStreamWrite64(&data, (uint64_t) slot);
+	LHStreamWrite32(&code, LHMakeAArch64AddReg(16, 17, 17));
+	LHStreamWrite32(&code, LHMakeAArch64LdrImm(0, 17, 16));
+	LHStreamWrite32(&code, LHMakeAArch64StrImm(1, 17, 16));
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(10), 16));
+	LHStreamWrite64(&data, (uint64_t) context);
+	LHStreamWrite32(&code, LHMakeAArch64StrImm(0, 17, 16));
+	LHStreamWrite32(&code, LHMakeAArch64LoadLiteral(1, 0, LH_LIT_OFFSET(10), 17));
+	LHStreamWrite64(&data, (uint64_t) handler);
+	LHStreamWrite32(&code, LHMakeAArch64Br(17));
+	LHStreamWrite32(&code, LHMakeAArch64Nop()); // keeps the literals aligned
+	
+	LHHookerAlignRwx(self, 8);
+	LH_COPY_TO_NEW_BLOCK();
 }
 
-#define LH_STREAM_MAX_SIZE 0x100
+#undef LH_LIT_OFFSET
 
-typedef struct LHStream {
-	uint8_t data[LH_STREAM_MAX_SIZE];
-	size_t head;
-} LHStream;
+#endif // LH_AARCH64
 
-static void LHStreamInit(LHStream *self) {
-	memset(self, 0, sizeof *self);
+static bool LHInstrumentEnter(void *data) {
+	LHCounters *counters = data;
+	
+	__atomic_fetch_add(&counters->calls, 1, __ATOMIC_RELAXED);
+	
+	return true;
 }
 
-static void LHStreamWrite(LHStream *self, size_t size, void *data) {
-	if (self->head + size > LH_STREAM_MAX_SIZE) {
-		// fail
-		return;
+static void LHInstrumentExit(void *data, uint64_t start, uint64_t end) {
+	LHCounters *counters = data;
+	uint64_t cycles = end - start;
+	size_t bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+	
+	if (bucket >= LH_HISTOGRAM_BUCKETS) {
+		bucket = LH_HISTOGRAM_BUCKETS - 1;
 	}
 	
-	memcpy(self->data + self->head, data, size);
-	self->head += size;
-}
-
-static size_t LHStreamWrite32(LHStream *self, uint32_t data) {
-	LHStreamWrite(self, sizeof data, &data);
-	return self->head - sizeof data;
-}
-
-static size_t LHStreamWrite64(LHStream *self, uint64_t data) {
-	LHStreamWrite(self, sizeof data, &data);
-	return self->head - sizeof data;
+	__atomic_fetch_add(&counters->cycles, cycles, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters->histogram[bucket], 1, __ATOMIC_RELAXED);
 }
 
-static size_t LHStreamTell(LHStream *self) {
-	return self->head;
-}
+static void *LHHookerMakeThunk(LHHooker *self, LHThunk *thunk) {
+	/**
+	 * Make the code for a thunk that goes through the shared stubs, making the
+	 * stubs first if this is the first one.
+	 */
+	
+	if (!self->thunk_entry) {
+#ifdef LH_AARCH64
+		LHHookerMakeAArch64Stubs(self);
+#else
+		LHHookerMakeX86Stubs(self);
+#endif
 
-#define LH_COPY_TO_NEW_BLOCK() void *new_block = LHHookerAllocRwx(self, LHStreamTell(&code) + LHStreamTell(&data)); \
-	memcpy(new_block, code.data, LHStreamTell(&code)); \
-	memcpy(new_block + LHStreamTell(&code), data.data, LHStreamTell(&data)); \
-	return new_block;
+		if (!self->thunk_entry) {
+			return NULL;
+		}
+	}
+	
+	thunk->exit_stub = self->thunk_exit;
 
 #ifdef LH_AARCH64
+	return LHHookerMakeAArch64Thunk(self, thunk);
+#else
+	return LHHookerMakeX86Thunk(self, thunk);
+#endif
+}
 
-// Offset from next instruction to next available data region
-#define LH_INS_OFFSET (((block_size + 2) * sizeof(uint32_t)) - LHStreamTell(&code) + LHStreamTell(&data))
+#endif // LH_AARCH64 || LH_X86_64
 
-static uint32_t *LHRewriteAArch64Block(LHHooker *self, uint32_t *old_block, size_t block_size) {
+bool LHHookerInstrument(LHHooker *self, void *function, LHCounters *counters) {
 	/**
-	 * Rewrite a block of instructions located at `old_block` to be position
-	 * indepedent, also inserting a jump back to (old_block + block_size) at the
-	 * end.
+	 * Count calls to `function` in `counters`, and if `counters->latency` is
+	 * set also time them and keep a histogram of how long they took. Timed
+	 * calls return through a per-thread shadow stack so they should not be
+	 * unwound by exceptions or longjmp.
 	 */
+
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+	LHCounters **list = realloc(self->counters, (self->counter_count + 1) * sizeof *list);
 	
-	LHStream code; LHStreamInit(&code);
-	LHStream data; LHStreamInit(&data);
+	if (!list) {
+		return false;
+	}
 	
-	for (size_t i = 0; i < block_size; i++) {
-		uint32_t ins = old_block[i];
-		
-		if (IS_AARCH64_ADR(ins)) {
-			uint32_t Rd = AARCH64_ADR_DECODE_RD(ins);
-			size_t imm = LH_SEXT64(AARCH64_ADR_DECODE_IMM(ins), 21);
-			
-			size_t result = (size_t) (((void *)&old_block[i]) + imm);
-			size_t offset = LH_INS_OFFSET;
-			
-			LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, offset >> 2, Rd));
-			LHStreamWrite64(&data, result);
-		}
-		else if (IS_AARCH64_ADRP(ins)) {
-			// similar to adr but works with respect to pages
-			uint32_t Rd = AARCH64_ADR_DECODE_RD(ins);
-			size_t imm = LH_SEXT64(AARCH64_ADR_DECODE_IMM(ins), 21) << 12;
-			
-			size_t result = (size_t) ((void *)&old_block[i]);
-			result &= 0xfffffffffffff000;
-			result += imm;
-			size_t offset = LH_INS_OFFSET;
-			
-			LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, offset >> 2, Rd));
-			LHStreamWrite64(&data, result);
-		}
-		else if (IS_AARCH64_LDR_LITERAL(ins)) {
-			bool x = AARCH64_LDR_LITERAL_DECODE_X(ins);
-			uint32_t Rt = AARCH64_LDR_LITERAL_DECODE_RT(ins);
-			size_t imm = LH_SEXT64(AARCH64_LDR_LITERAL_DECODE_IMM(ins), 19) << 2;
-			
-			LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(x, LH_INS_OFFSET >> 2, Rt));
-			
-			if (x) {
-				uint64_t d = ((uint64_t *)(((void *)&old_block[i]) + imm))[i];
-				LHStreamWrite64(&data, d);
-			}
-			else {
-				uint32_t d = ((uint32_t *)(((void *)&old_block[i]) + imm))[i];
-				LHStreamWrite32(&data, d);
-			}
+	self->counters = list;
+	counters->function = function;
+	
+	if (counters->latency) {
+		if (!LHHookerWrap(self, function, LHInstrumentEnter, LHInstrumentExit, counters)) {
+			return false;
 		}
-		else {
-			LHStreamWrite32(&code, ins);
+	}
+	else {
+		void **orig;
+#ifdef LH_AARCH64
+		void *code = LHHookerMakeAArch64CountThunk(self, &counters->calls, &orig);
+#else
+		void *code = LHHookerMakeX86CountThunk(self, &counters->calls, &orig);
+#endif
+
+		if (!code || !LHHookerHookFunction(self, function, code, orig)) {
+			return false;
 		}
 	}
 	
-	// Insert jump back to end
-	// TODO: Actually figure out which registers are available to use instead of
-	// just using x17
-	LHStreamWrite32(&code, MAKE_AARCH64_LDR_LITERAL(1, LH_INS_OFFSET >> 2, 16));
-	LHStreamWrite32(&code, MAKE_AARCH64_BR(16));
-	LHStreamWrite64(&data, (size_t)(old_block + block_size));
+	self->counters[self->counter_count++] = counters;
 	
-	// Copy to rwx block
-	LH_COPY_TO_NEW_BLOCK();
+	return true;
+#else
+	return false;
+#endif
 }
 
-static void LHWriteAArch64LongJump(uint32_t *code, void *target) {
-	code[0] = MAKE_AARCH64_LDR_LITERAL(1, 8 >> 2, 16);
-	code[1] = MAKE_AARCH64_BR(16);
-	code[2] = ((uint32_t *)&target)[0];
-	code[3] = ((uint32_t *)&target)[1];
+bool LHHookerWrap(LHHooker *self, void *function, LHWrapEnterFunc enter, LHWrapExitFunc exit, void *data) {
+	/**
+	 * Call `enter(data)` every time `function` is called, and if it returns
+	 * true, `exit(data, start, end)` once that call returns. Like timed
+	 * instrumentation, calls that get an exit callback return through a
+	 * per-thread shadow stack, so they should not be unwound by exceptions or
+	 * longjmp.
+	 */
+
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+	LHThunk *thunk = LHHookerAllocThunk(self);
+	
+	if (!thunk) {
+		return false;
+	}
+	
+	thunk->enter = enter;
+	thunk->exit = exit;
+	thunk->data = data;
+	
+	void *code = LHHookerMakeThunk(self, thunk);
+	
+	return code && LHHookerHookFunction(self, function, code, &thunk->orig);
+#else
+	return false;
+#endif
 }
 
-static bool LHHookerAArch64Function(LHHooker *self, uint32_t *function, uint32_t *hook, uint32_t **orig) {
-	if (orig) {
-		uint32_t *orig_ptr = LHRewriteAArch64Block(self, function, 4);
-		
-		if (!orig_ptr) {
-			return false;
-		}
-		
-		orig[0] = orig_ptr;
+bool LHHookerHookWithContext(LHHooker *self, void *function, void *handler, void *user_data, void **orig) {
+	/**
+	 * Hook `function` to call `handler`, which has the same signature, and
+	 * let it get `user_data` and the original from LHHookerEnterContext().
+	 * One handler can serve any number of functions this way. Optionally
+	 * write where the original can be called to `orig`.
+	 */
+
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+	intptr_t slot;
+	
+	if (!LHContextSlotOffset(&slot)) {
+		return false;
+	}
+	
+	LHHookerAlignRwx(self, 8);
+	
+	LHContext *context = LHHookerAllocRwx(self, sizeof *context);
+	
+	if (!context) {
+		return false;
+	}
+	
+	context->function = function;
+	context->orig = NULL;
+	context->user_data = user_data;
+
+#ifdef LH_AARCH64
+	void *code = LHHookerMakeAArch64ContextThunk(self, context, handler, slot);
+#else
+	void *code = LHHookerMakeX86ContextThunk(self, context, handler, slot);
+#endif
+
+	if (!code || !LHHookerHookFunction(self, function, code, &context->orig)) {
+		return false;
 	}
 	
-	LHWriteAArch64LongJump(function, hook);
+	if (orig) {
+		*orig = context->orig;
+	}
 	
 	return true;
+#else
+	return false;
+#endif
 }
 
-#undef LH_INS_OFFSET
+LHContext *LHHookerCurrentContext(void) {
+	/**
+	 * Get the context of the innermost context hook on this thread that is
+	 * running and hasn't left it
+	 */
 
-#endif // LH_AARCH64
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+	return gLHContext.current;
+#else
+	return NULL;
+#endif
+}
 
-#ifdef LH_AARCH32
+LHContext *LHHookerEnterContext(LHContext **caller) {
+	/**
+	 * Call first thing in a handler to get the context it was entered for.
+	 * The context it replaced goes in `caller`, keep it in the handler's
+	 * frame and pass it to LHHookerLeaveContext() before returning, so
+	 * handlers can call other context hooks, or their own, to any depth.
+	 */
 
-// AArch32, so the PC points to (instruction + 8) for regular arm modea
-#define LH_INS_OFFSET (((block_size + 2) * sizeof(uint32_t)) - LHStreamTell(&code) + LHStreamTell(&data) - 8)
-#define LH_PC_VALUE_ALIGNED ((((uint32_t)&old_block[i]) + 8) & 0xfffffffc)
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+	*caller = gLHContext.caller;
+	return gLHContext.current;
+#else
+	*caller = NULL;
+	return NULL;
+#endif
+}
 
-uint32_t *LHRewriteAArch32Block(LHHooker *self, uint32_t *old_block, size_t block_size) {
+void LHHookerLeaveContext(LHContext *caller) {
 	/**
-	 * Rewrite a block of asm so that it is position indepedent (for our
-	 * purposes) and has a jump back to the old block at the end.
+	 * Put back the context that LHHookerEnterContext() returned in `caller`
+	 */
+
+#if defined(LH_AARCH64) || defined(LH_X86_64)
+	gLHContext.current = caller;
+#else
+	(void) caller;
+#endif
+}
+
+size_t LHHookerSnapshotCounters(LHHooker *self, LHCounters *out, size_t max_count, bool reset) {
+	/**
+	 * Copy the counters of up to `max_count` instrumented functions to `out`,
+	 * optionally resetting all of them, and return the number of instrumented
+	 * functions.
 	 */
 	
-	LHStream code; LHStreamInit(&code);
-	LHStream data; LHStreamInit(&data);
-	
-	for (size_t i = 0; i < block_size; i++) {
-		uint32_t ins = old_block[i];
+	for (size_t i = 0; i < self->counter_count; i++) {
+		LHCounters *counters = self->counters[i];
+		LHCounters copy = *counters;
 		
-		if (IS_AARCH32_ADR(ins)) {
-			uint32_t Rd = AARCH32_ADR_DECODE_RD(ins);
-			uint32_t imm = AARCH32_ADR_DECODE_IMM(ins);
-			
-			uint32_t result = LH_PC_VALUE_ALIGNED;
-			result += imm;
-			
-			LHStreamWrite32(&code, MAKE_AARCH32_LDR_LITERAL(1, Rd, LH_INS_OFFSET));
-			LHStreamWrite32(&data, result);
+		if (reset) {
+			copy.calls = __atomic_exchange_n(&counters->calls, 0, __ATOMIC_RELAXED);
+			copy.cycles = __atomic_exchange_n(&counters->cycles, 0, __ATOMIC_RELAXED);
 		}
-		else if (IS_AARCH32_ADR_SUB(ins)) {
-			uint32_t Rd = AARCH32_ADR_DECODE_RD(ins);
-			uint32_t imm = AARCH32_ADR_DECODE_IMM(ins);
-			
-			uint32_t result = LH_PC_VALUE_ALIGNED;
-			result -= imm;
-			
-			LHStreamWrite32(&code, MAKE_AARCH32_LDR_LITERAL(1, Rd, LH_INS_OFFSET));
-			LHStreamWrite32(&data, result);
+		else {
+			copy.calls = __atomic_load_n(&counters->calls, __ATOMIC_RELAXED);
+			copy.cycles = __atomic_load_n(&counters->cycles, __ATOMIC_RELAXED);
 		}
-		else if (IS_AARCH32_LDR_LITERAL(ins)) {
-			bool U = AARCH32_LDR_LITERAL_DECODE_U(ins);
-			uint32_t Rt = AARCH32_LDR_LITERAL_DECODE_RT(ins);
-			uint32_t imm = AARCH32_LDR_LITERAL_DECODE_IMM(ins);
-			
-			uint32_t addr = LH_PC_VALUE_ALIGNED;
-			
-			if (U) {
-				addr += imm;
+		
+		for (size_t j = 0; j < LH_HISTOGRAM_BUCKETS; j++) {
+			if (reset) {
+				copy.histogram[j] = __atomic_exchange_n(&counters->histogram[j], 0, __ATOMIC_RELAXED);
 			}
 			else {
-				addr -= imm;
+				copy.histogram[j] = __atomic_load_n(&counters->histogram[j], __ATOMIC_RELAXED);
 			}
-			
-			uint32_t offset = LH_INS_OFFSET;
-			
-			LHStreamWrite32(&code, MAKE_AARCH32_LDR_LITERAL(1, Rt, offset));
-			LHStreamWrite32(&data, ((uint32_t *)addr)[0]);
-		}
-		else {
-			LHStreamWrite32(&code, ins);
 		}
-	}
-	
-	// Insert jump back to rest of function
-	LHStreamWrite32(&code, MAKE_AARCH32_LDR_LITERAL(1, 12, LH_INS_OFFSET));
-	LHStreamWrite32(&code, MAKE_AARCH32_BX(12));
-	LHStreamWrite32(&data, (uint32_t)(old_block + block_size));
-	
-	// Copy to rwx block
-	LH_COPY_TO_NEW_BLOCK();
-}
-
-void LHWriteAArch32LongJump(uint32_t *code, void *target) {
-	code[0] = MAKE_AARCH32_LDR_LITERAL(1, 12, 0);
-	code[1] = MAKE_AARCH32_BX(12);
-	code[2] = (uint32_t)target;
-}
-
-static bool LHHookerAArch32Function(LHHooker *self, uint32_t *function, uint32_t *hook, uint32_t **orig) {
-	if (orig) {
-		uint32_t *orig_ptr = LHRewriteAArch32Block(self, function, 3);
 		
-		if (!orig_ptr) {
-			return false;
+		if (i < max_count) {
+			out[i] = copy;
 		}
-		
-		orig[0] = orig_ptr;
 	}
 	
-	LHWriteAArch32LongJump(function, hook);
-	
-	return true;
+	return self->counter_count;
 }
 
-#undef LH_PC_VALUE_ALIGNED
-#undef LH_INS_OFFSET
-
-#endif
-
-bool LHHookerHookFunction(LHHooker *self, void *function, void *hook, void **orig) {
+void LHHookerResetCounters(LHHooker *self) {
 	/**
-	 * Hook the function pointed to by `function` to call `hook`. Optionally
-	 * write a pointer to where the original function can be invoked at `orig`,
-	 * if it is not null.
+	 * Reset the counters of every instrumented function
 	 */
 	
-	bool success = false;
-#ifdef LH_AARCH64
-	success = LHHookerAArch64Function(self, function, hook, (uint32_t **) orig);
-#elif defined(LH_AARCH32)
-	success = LHHookerAArch32Function(self, function, hook, (uint32_t **) orig);
-#endif
-	return success;
+	LHHookerSnapshotCounters(self, NULL, 0, true);
 }
 
 #endif // LEAFHOOK_IMPLEMENTATION
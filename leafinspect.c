@@ -0,0 +1,96 @@
+// Summarise shared objects without loading them, and say if Leaf could load
+// them on this machine. Exits with 1 if any of them can't be loaded.
+//
+// gcc leafinspect.c -o leafinspect -ldl -lpthread
+// ./leafinspect [-q] lib/*.so
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LEAF_IMPLEMENTATION
+#include "leaf.h"
+
+static void PrintReport(const char *path, LeafInspectReport *report) {
+	printf("%s:\n", path);
+	printf("\tclass: %d-bit, machine: %d\n", report->elf_class == ELFCLASS64 ? 64 : 32, report->machine);
+	printf("\timage: 0x%llx bytes, 0x%llx from file, %zu segments\n", (unsigned long long) report->image_size, (unsigned long long) report->file_size, report->segment_count);
+	
+	for (size_t i = 0; i < report->segment_count && i < LEAF_INSPECT_MAX_SEGMENTS; i++) {
+		LeafInspectSegment *seg = &report->segments[i];
+		printf("\t\t0x%08llx +0x%llx (0x%llx in file) %c%c%c\n", (unsigned long long) seg->vaddr, (unsigned long long) seg->memsz, (unsigned long long) seg->filesz, seg->flags & PF_R ? 'r' : '-', seg->flags & PF_W ? 'w' : '-', seg->flags & PF_X ? 'x' : '-');
+	}
+	
+	for (size_t i = 0; i < report->needed_count && i < LEAF_INSPECT_MAX_NEEDED; i++) {
+		printf("\tneeds: %s\n", report->needed[i] ? report->needed[i] : "(bad name)");
+	}
+	
+	printf("\tsymbols: %zu (%zu imports, %zu exports)%s%s%s\n", report->symbol_count, report->import_count, report->export_count, report->has_hash ? " hash" : "", report->has_gnu_hash ? " gnu_hash" : "", report->has_tls ? " tls" : "");
+	printf("\trelocs: %zu, %zu unsupported, %zu initialisers\n", report->reloc_count, report->unsupported_reloc_count, report->init_count);
+	
+	for (size_t i = 0; i < report->reloc_type_count; i++) {
+		printf("\t\ttype %u: %zu%s\n", report->reloc_types[i].type, report->reloc_types[i].count, report->reloc_types[i].supported ? "" : " (unsupported)");
+	}
+	
+	printf("\testimated load time: %llu us\n", (unsigned long long) report->est_load_us);
+}
+
+int main(int argc, const char *argv[]) {
+	bool quiet = false;
+	int status = 0;
+	
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-q")) {
+			quiet = true;
+			continue;
+		}
+		
+		int fd = open(argv[i], O_RDONLY);
+		struct stat st;
+		
+		if (fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+			printf("%s: could not open\n", argv[i]);
+			status = 1;
+			
+			if (fd >= 0) {
+				close(fd);
+			}
+			
+			continue;
+		}
+		
+		void *contents = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		
+		if (contents == MAP_FAILED) {
+			printf("%s: could not map\n", argv[i]);
+			status = 1;
+			continue;
+		}
+		
+		LeafInspectReport report;
+		const char *error = LeafInspect(contents, st.st_size, &report);
+		
+		if (error) {
+			printf("%s: %s\n", argv[i], error);
+			status = 1;
+		}
+		else {
+			if (!quiet) {
+				PrintReport(argv[i], &report);
+			}
+			
+			printf("%s: %s\n", argv[i], report.loadable ? "loadable" : report.problem);
+			
+			if (!report.loadable) {
+				status = 1;
+			}
+		}
+		
+		munmap(contents, st.st_size);
+	}
+	
+	return status;
+}
@@ -0,0 +1,795 @@
+/**
+ * LeafProf - sampling profiler for code loaded with Leaf
+ *
+ * *****************************************************************************
+ *
+ * Usage:
+ *
+ *  - Include leaf.h first, then define `LEAFPROF_IMPLEMENTATION` in one file
+ *  - Create a profiler for a loaded library (`LPProfilerCreate()`)
+ *  - Call `LPProfilerAddThread()` on each thread that should be sampled
+ *  - `LPProfilerStart()`, run things, `LPProfilerStop()`
+ *  - Write what was sampled as collapsed stacks (`LPProfilerWriteCollapsed()`)
+ *    for flamegraph.pl, speedscope, pprof's collapsed importer, etc.
+ *
+ * Each added thread gets a timer on its own CPU time that sends it SIGPROF.
+ * The handler walks the frame pointers and writes the stack to a ring buffer
+ * owned by the thread, without locking or allocating. A collector thread
+ * drains the rings while running, and addresses are only turned into names
+ * when writing. Stacks are only complete through code built with frame
+ * pointers (`-fno-omit-frame-pointer`), otherwise just the sampled function
+ * is reliable. Even then, a function that doesn't make a frame hides its
+ * direct caller. Frame walking is done on x86-64 and AArch64, elsewhere only
+ * the PC is recorded.
+ *
+ * CPU time timers are checked on the kernel's tick, so the rate you actually
+ * get is capped at CONFIG_HZ per thread.
+ *
+ * Only one profiler can be running at a time since they share SIGPROF. If
+ * SIGPROF had its default action before starting, it is left ignored after
+ * stopping, since a late sample would otherwise kill the process.
+ */
+
+#ifndef _LEAFPROF_HEADER
+#define _LEAFPROF_HEADER
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <ucontext.h>
+
+#ifndef LEAF_HEADER
+#error "Include leaf.h before leafprof.h"
+#endif
+
+// Deepest stack that is recorded, frames past this are dropped
+#define LP_MAX_FRAMES 32
+
+// Samples each thread can have waiting for the collector, a power of two
+#define LP_RING_SIZE 256
+
+// How often the collector drains the rings, in milliseconds
+#define LP_COLLECT_INTERVAL 100
+
+typedef struct LPSample {
+	uint32_t frame_count;
+	uintptr_t frames[LP_MAX_FRAMES]; // frames[0] is the sampled PC
+} LPSample;
+
+typedef struct LPStack {
+	uint64_t count;
+	LPSample sample;
+} LPStack;
+
+typedef struct LPThread LPThread;
+
+typedef struct LPProfiler {
+	Leaf *leaf;
+	uint32_t frequency;
+	bool running; // Only accessed atomically
+	pthread_mutex_t lock; // Protects threads and stacks
+	LPThread *threads;
+	LPStack *stacks; // Distinct stacks seen so far
+	size_t stack_count;
+	size_t stack_capacity;
+	uint32_t *stack_index; // Open addressing table of stacks + 1
+	size_t stack_index_size;
+	uint64_t samples; // Total collected
+	uint64_t dropped; // Lost because a ring was full
+	pthread_t collector;
+	bool collector_stop; // Only accessed atomically
+	struct sigaction old_action;
+} LPProfiler;
+
+LPProfiler *LPProfilerCreate(Leaf *leaf, uint32_t frequency);
+void LPProfilerRelease(LPProfiler *self);
+bool LPProfilerAddThread(LPProfiler *self);
+void LPProfilerRemoveThread(LPProfiler *self);
+bool LPProfilerStart(LPProfiler *self);
+void LPProfilerStop(LPProfiler *self);
+void LPProfilerCollect(LPProfiler *self);
+bool LPProfilerWriteCollapsed(LPProfiler *self, FILE *out);
+
+#ifdef LEAFPROF_IMPLEMENTATION
+
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID 4
+#endif
+
+// Register numbers in mcontext gregs, <sys/ucontext.h> only names them with
+// _GNU_SOURCE
+#define LP_X86_REG_RBP 10
+#define LP_X86_REG_RSP 15
+#define LP_X86_REG_RIP 16
+
+// Not declared without _GNU_SOURCE, but always there on Linux
+int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
+
+struct LPThread {
+	LPThread *next;
+	LPProfiler *profiler;
+	pid_t tid;
+	timer_t timer;
+	bool has_timer;
+	bool removed;
+	uintptr_t stack_low, stack_high; // Frame pointers outside this are junk
+	uint32_t head; // Written by the signal handler
+	uint32_t tail; // Written by the collector
+	uint64_t dropped; // Only accessed atomically
+	LPSample samples[LP_RING_SIZE];
+};
+
+// Initial exec so that the signal handler never has to allocate a TLS block
+__attribute__((tls_model("initial-exec"))) static __thread LPThread *tLPThread;
+
+static void LPCapture(LPThread *thread, ucontext_t *context, LPSample *sample) {
+	/**
+	 * Record the interrupted PC and the return addresses in the frame pointer
+	 * chain. Only reads memory inside the thread's stack.
+	 */
+	
+	uintptr_t pc, fp, sp;
+
+#if defined(__x86_64__)
+	pc = context->uc_mcontext.gregs[LP_X86_REG_RIP];
+	fp = context->uc_mcontext.gregs[LP_X86_REG_RBP];
+	sp = context->uc_mcontext.gregs[LP_X86_REG_RSP];
+#elif defined(__aarch64__)
+	pc = context->uc_mcontext.pc;
+	fp = context->uc_mcontext.regs[29];
+	sp = context->uc_mcontext.sp;
+#elif defined(__arm__)
+	pc = context->uc_mcontext.arm_pc;
+	fp = 0;
+	sp = 0;
+#else
+	pc = 0;
+	fp = 0;
+	sp = 0;
+#endif
+
+	sample->frames[0] = pc;
+	sample->frame_count = 1;
+	
+	// Both keep the caller's frame pointer at [fp] and the return address
+	// at [fp + 8]
+	while (sample->frame_count < LP_MAX_FRAMES) {
+		if ((fp & (sizeof(uintptr_t) - 1)) || fp < sp || fp < thread->stack_low || fp + 2 * sizeof(uintptr_t) > thread->stack_high) {
+			break;
+		}
+		
+		uintptr_t next = ((uintptr_t *) fp)[0];
+		uintptr_t ret = ((uintptr_t *) fp)[1];
+		
+		if (!ret) {
+			break;
+		}
+		
+		sample->frames[sample->frame_count++] = ret;
+		
+		// Stacks grow down, so callers' frames are always higher
+		if (next <= fp) {
+			break;
+		}
+		
+		fp = next;
+	}
+}
+
+static void LPSignalHandler(int signal, siginfo_t *info, void *context) {
+	(void) signal;
+	(void) info;
+	
+	int saved_errno = errno;
+	LPThread *thread = tLPThread;
+	
+	if (thread && !thread->removed && __atomic_load_n(&thread->profiler->running, __ATOMIC_RELAXED)) {
+		uint32_t head = thread->head;
+		uint32_t tail = __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE);
+		
+		if (head - tail >= LP_RING_SIZE) {
+			__atomic_fetch_add(&thread->dropped, 1, __ATOMIC_RELAXED);
+		}
+		else {
+			LPCapture(thread, context, &thread->samples[head & (LP_RING_SIZE - 1)]);
+			__atomic_store_n(&thread->head, head + 1, __ATOMIC_RELEASE);
+		}
+	}
+	
+	errno = saved_errno;
+}
+
+LPProfiler *LPProfilerCreate(Leaf *leaf, uint32_t frequency) {
+	/**
+	 * Create a profiler for code in `leaf`, sampling each thread `frequency`
+	 * times per second of CPU time it uses (100 if 0).
+	 */
+	
+	LPProfiler *self = malloc(sizeof *self);
+	
+	if (!self) {
+		return NULL;
+	}
+	
+	memset(self, 0, sizeof *self);
+	
+	self->leaf = leaf;
+	self->frequency = frequency ? frequency : 100;
+	pthread_mutex_init(&self->lock, NULL);
+	
+	return self;
+}
+
+static bool LPThreadArm(LPProfiler *self, LPThread *thread, bool on) {
+	struct itimerspec spec = {0};
+	
+	if (on) {
+		spec.it_interval.tv_nsec = 1000000000 / self->frequency;
+		spec.it_value = spec.it_interval;
+	}
+	
+	return !timer_settime(thread->timer, 0, &spec, NULL);
+}
+
+bool LPProfilerAddThread(LPProfiler *self) {
+	/**
+	 * Start sampling the calling thread whenever the profiler is running.
+	 * Call LPProfilerRemoveThread() before the thread exits.
+	 */
+	
+	LPThread *thread = calloc(1, sizeof *thread);
+	
+	if (!thread) {
+		return false;
+	}
+	
+	thread->profiler = self;
+	thread->tid = syscall(SYS_gettid);
+	
+	// Bounds for frame pointer walking
+	pthread_attr_t attr;
+	void *stack;
+	size_t stack_size;
+	
+	if (!pthread_getattr_np(pthread_self(), &attr)) {
+		if (!pthread_attr_getstack(&attr, &stack, &stack_size)) {
+			thread->stack_low = (uintptr_t) stack;
+			thread->stack_high = (uintptr_t) stack + stack_size;
+		}
+		
+		pthread_attr_destroy(&attr);
+	}
+	
+	struct sigevent event = {0};
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event._sigev_un._tid = thread->tid;
+	
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &thread->timer)) {
+		free(thread);
+		return false;
+	}
+	
+	thread->has_timer = true;
+	tLPThread = thread;
+	
+	pthread_mutex_lock(&self->lock);
+	
+	thread->next = self->threads;
+	self->threads = thread;
+	
+	if (__atomic_load_n(&self->running, __ATOMIC_RELAXED)) {
+		LPThreadArm(self, thread, true);
+	}
+	
+	pthread_mutex_unlock(&self->lock);
+	
+	return true;
+}
+
+void LPProfilerRemoveThread(LPProfiler *self) {
+	/**
+	 * Stop sampling the calling thread. Samples it already took are kept.
+	 */
+	
+	LPThread *thread = tLPThread;
+	
+	if (!thread || thread->profiler != self) {
+		return;
+	}
+	
+	pthread_mutex_lock(&self->lock);
+	
+	timer_delete(thread->timer);
+	thread->has_timer = false;
+	thread->removed = true;
+	tLPThread = NULL;
+	
+	pthread_mutex_unlock(&self->lock);
+}
+
+static uint64_t LPStackHash(const LPSample *sample) {
+	uint64_t hash = 0xcbf29ce484222325;
+	
+	for (size_t i = 0; i < sample->frame_count; i++) {
+		hash = (hash ^ sample->frames[i]) * 0x100000001b3;
+	}
+	
+	return hash;
+}
+
+static bool LPStackGrowIndex(LPProfiler *self) {
+	size_t size = self->stack_index_size ? self->stack_index_size * 2 : 1024;
+	uint32_t *index = calloc(size, sizeof *index);
+	
+	if (!index) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < self->stack_count; i++) {
+		size_t slot = LPStackHash(&self->stacks[i].sample) & (size - 1);
+		
+		while (index[slot]) {
+			slot = (slot + 1) & (size - 1);
+		}
+		
+		index[slot] = i + 1;
+	}
+	
+	free(self->stack_index);
+	self->stack_index = index;
+	self->stack_index_size = size;
+	
+	return true;
+}
+
+static void LPStackAdd(LPProfiler *self, const LPSample *sample) {
+	/**
+	 * Count a sample towards its stack, adding the stack if it is new
+	 */
+	
+	if (self->stack_count * 2 >= self->stack_index_size && !LPStackGrowIndex(self)) {
+		self->dropped++;
+		return;
+	}
+	
+	size_t mask = self->stack_index_size - 1;
+	size_t slot = LPStackHash(sample) & mask;
+	
+	for (; self->stack_index[slot]; slot = (slot + 1) & mask) {
+		LPStack *stack = &self->stacks[self->stack_index[slot] - 1];
+		
+		if (stack->sample.frame_count == sample->frame_count && !memcmp(stack->sample.frames, sample->frames, sample->frame_count * sizeof *sample->frames)) {
+			stack->count++;
+			return;
+		}
+	}
+	
+	if (self->stack_count == self->stack_capacity) {
+		size_t capacity = self->stack_capacity ? self->stack_capacity * 2 : 256;
+		LPStack *stacks = realloc(self->stacks, capacity * sizeof *stacks);
+		
+		if (!stacks) {
+			self->dropped++;
+			return;
+		}
+		
+		self->stacks = stacks;
+		self->stack_capacity = capacity;
+	}
+	
+	LPStack *stack = &self->stacks[self->stack_count];
+	stack->count = 1;
+	stack->sample.frame_count = sample->frame_count;
+	memcpy(stack->sample.frames, sample->frames, sample->frame_count * sizeof *sample->frames);
+	
+	self->stack_index[slot] = ++self->stack_count;
+}
+
+void LPProfilerCollect(LPProfiler *self) {
+	/**
+	 * Move samples from the threads' rings into the profile. The collector
+	 * thread does this while the profiler is running.
+	 */
+	
+	pthread_mutex_lock(&self->lock);
+	
+	for (LPThread *thread = self->threads; thread; thread = thread->next) {
+		uint32_t head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = thread->tail;
+		
+		for (; tail != head; tail++) {
+			LPStackAdd(self, &thread->samples[tail & (LP_RING_SIZE - 1)]);
+			self->samples++;
+		}
+		
+		__atomic_store_n(&thread->tail, tail, __ATOMIC_RELEASE);
+		
+		// Take what the handler has counted so far
+		uint64_t dropped = __atomic_exchange_n(&thread->dropped, 0, __ATOMIC_RELAXED);
+		self->dropped += dropped;
+	}
+	
+	pthread_mutex_unlock(&self->lock);
+}
+
+static void *LPCollectorThread(void *arg) {
+	LPProfiler *self = arg;
+	struct timespec interval = {0, LP_COLLECT_INTERVAL * 1000000};
+	
+	while (!__atomic_load_n(&self->collector_stop, __ATOMIC_RELAXED)) {
+		nanosleep(&interval, NULL);
+		LPProfilerCollect(self);
+	}
+	
+	return NULL;
+}
+
+bool LPProfilerStart(LPProfiler *self) {
+	/**
+	 * Install the SIGPROF handler and start sampling added threads
+	 */
+	
+	if (__atomic_load_n(&self->running, __ATOMIC_RELAXED)) {
+		return true;
+	}
+	
+	struct sigaction action = {0};
+	action.sa_sigaction = LPSignalHandler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	
+	if (sigaction(SIGPROF, &action, &self->old_action)) {
+		return false;
+	}
+	
+	__atomic_store_n(&self->collector_stop, false, __ATOMIC_RELAXED);
+	
+	if (pthread_create(&self->collector, NULL, LPCollectorThread, self)) {
+		sigaction(SIGPROF, &self->old_action, NULL);
+		return false;
+	}
+	
+	pthread_mutex_lock(&self->lock);
+	
+	__atomic_store_n(&self->running, true, __ATOMIC_RELAXED);
+	
+	for (LPThread *thread = self->threads; thread; thread = thread->next) {
+		if (thread->has_timer) {
+			LPThreadArm(self, thread, true);
+		}
+	}
+	
+	pthread_mutex_unlock(&self->lock);
+	
+	return true;
+}
+
+void LPProfilerStop(LPProfiler *self) {
+	/**
+	 * Stop sampling and collect what is left in the rings
+	 */
+	
+	if (!__atomic_load_n(&self->running, __ATOMIC_RELAXED)) {
+		return;
+	}
+	
+	pthread_mutex_lock(&self->lock);
+	
+	__atomic_store_n(&self->running, false, __ATOMIC_RELAXED);
+	
+	for (LPThread *thread = self->threads; thread; thread = thread->next) {
+		if (thread->has_timer) {
+			LPThreadArm(self, thread, false);
+		}
+	}
+	
+	pthread_mutex_unlock(&self->lock);
+	
+	__atomic_store_n(&self->collector_stop, true, __ATOMIC_RELAXED);
+	pthread_join(self->collector, NULL);
+	
+	// A SIGPROF that was sent before the timers were disarmed can still be
+	// pending on a thread that has it blocked. The default action for it
+	// kills the process, so ignore it instead, which also throws away any
+	// that are pending. A handler someone else installed gets put back.
+	if (!(self->old_action.sa_flags & SA_SIGINFO) && self->old_action.sa_handler == SIG_DFL) {
+		struct sigaction ignore = {0};
+		ignore.sa_handler = SIG_IGN;
+		sigemptyset(&ignore.sa_mask);
+		sigaction(SIGPROF, &ignore, NULL);
+	}
+	else {
+		sigaction(SIGPROF, &self->old_action, NULL);
+	}
+	
+	LPProfilerCollect(self);
+}
+
+void LPProfilerRelease(LPProfiler *self) {
+	/**
+	 * Stop and free the profiler. Threads that are still added stop being
+	 * sampled.
+	 */
+	
+	if (!self) {
+		return;
+	}
+	
+	LPProfilerStop(self);
+	
+	for (LPThread *thread = self->threads; thread;) {
+		LPThread *next = thread->next;
+		
+		if (thread->has_timer) {
+			timer_delete(thread->timer);
+		}
+		
+		// A thread that didn't remove itself still points here
+		if (tLPThread == thread) {
+			tLPThread = NULL;
+		}
+		
+		thread->removed = true;
+		thread = next;
+	}
+	
+	// Other threads might still have their pointer, so the threads are only
+	// freed once we know nothing can be sampled
+	for (LPThread *thread = self->threads; thread;) {
+		LPThread *next = thread->next;
+		free(thread);
+		thread = next;
+	}
+	
+	pthread_mutex_destroy(&self->lock);
+	free(self->stacks);
+	free(self->stack_index);
+	free(self);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Symbolising
+//////////////
+
+typedef struct LPSymbol {
+	uintptr_t start;
+	uintptr_t end;
+	const char *name;
+} LPSymbol;
+
+// Same layout as Dl_info, which glibc only has with _GNU_SOURCE
+typedef struct LPDlInfo {
+	const char *fname;
+	void *fbase;
+	const char *sname;
+	void *saddr;
+} LPDlInfo;
+
+typedef int (*LPDladdrFunc)(const void *address, LPDlInfo *info);
+
+static int LPSymbolCompare(const void *a, const void *b) {
+	const LPSymbol *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static LPSymbol *LPSymbolTable(Leaf *leaf, size_t *count) {
+	/**
+	 * Function symbols defined by the loaded library, sorted by address. The
+	 * symbol table has been relocated so the values are addresses.
+	 */
+	
+	LPSymbol *table = malloc((leaf->sym_count + 1) * sizeof *table);
+	
+	*count = 0;
+	
+	if (!table) {
+		return NULL;
+	}
+	
+	for (size_t i = 0; i < leaf->sym_count; i++) {
+		LeafSym *sym = &leaf->symtab[i];
+		if (sym->st_shndx == SHN_UNDEF || sym->st_size == 0 || LeafSymType(sym->st_info) != STT_FUNC) {
+			continue;
+		}
+		
+		table[*count].start = sym->st_value;
+		table[*count].end = sym->st_value + sym->st_size;
+		table[*count].name = leaf->strtab + sym->st_name;
+		(*count)++;
+	}
+	
+	qsort(table, *count, sizeof *table, LPSymbolCompare);
+	
+	return table;
+}
+
+static void LPSymbolise(LPProfiler *self, LPSymbol *table, size_t count, LPDladdrFunc dladdr_func, uintptr_t address, char *out, size_t size) {
+	/**
+	 * Name the function containing `address`, using the library's symbols if
+	 * it is in the library
+	 */
+	
+	uintptr_t blob = (uintptr_t) self->leaf->blob;
+	
+	if (address >= blob && address < blob + self->leaf->blob_length) {
+		size_t low = 0, high = count;
+		
+		// Last symbol starting at or before the address
+		while (low < high) {
+			size_t mid = (low + high) / 2;
+			
+			if (table[mid].start <= address) {
+				low = mid + 1;
+			}
+			else {
+				high = mid;
+			}
+		}
+		
+		if (low && address < table[low - 1].end) {
+			snprintf(out, size, "%s", table[low - 1].name);
+		}
+		else {
+			snprintf(out, size, "[leaf+0x%zx]", (size_t) (address - blob));
+		}
+		
+		return;
+	}
+	
+	LPDlInfo info;
+	
+	if (dladdr_func && dladdr_func((void *) address, &info)) {
+		if (info.sname) {
+			snprintf(out, size, "%s", info.sname);
+			return;
+		}
+		
+		if (info.fname) {
+			const char *base = strrchr(info.fname, '/');
+			snprintf(out, size, "[%s]", base ? base + 1 : info.fname);
+			return;
+		}
+	}
+	
+	snprintf(out, size, "[unknown]");
+}
+
+typedef struct LPLine {
+	char *text;
+	uint64_t count;
+} LPLine;
+
+static int LPLineCompare(const void *a, const void *b) {
+	return strcmp(((const LPLine *) a)->text, ((const LPLine *) b)->text);
+}
+
+static char *LPStackText(LPProfiler *self, LPStack *stack, LPSymbol *table, size_t count, LPDladdrFunc dladdr_func) {
+	/**
+	 * Names of the frames in a stack from the outermost caller in, separated
+	 * by ';'
+	 */
+	
+	char name[256];
+	size_t length = 0, capacity = 256;
+	char *text = malloc(capacity);
+	
+	if (!text) {
+		return NULL;
+	}
+	
+	text[0] = '\0';
+	
+	for (size_t j = stack->sample.frame_count; j-- > 0;) {
+		// Return addresses point after the call, which can be the start of
+		// the next function
+		uintptr_t address = j ? stack->sample.frames[j] - 1 : stack->sample.frames[j];
+		
+		LPSymbolise(self, table, count, dladdr_func, address, name, sizeof name);
+		
+		size_t name_length = strlen(name);
+		
+		if (length + name_length + 2 > capacity) {
+			capacity = (length + name_length + 2) * 2;
+			char *grown = realloc(text, capacity);
+			
+			if (!grown) {
+				free(text);
+				return NULL;
+			}
+			
+			text = grown;
+		}
+		
+		memcpy(text + length, name, name_length);
+		length += name_length;
+		
+		if (j) {
+			text[length++] = ';';
+		}
+		
+		text[length] = '\0';
+	}
+	
+	return text;
+}
+
+bool LPProfilerWriteCollapsed(LPProfiler *self, FILE *out) {
+	/**
+	 * Write the profile as collapsed stacks, one line per stack with frames
+	 * from the outermost caller in, and how many times it was sampled.
+	 * Stacks that only differ in addresses within the same functions are
+	 * written as one line.
+	 */
+	
+	LPProfilerCollect(self);
+	
+	size_t count;
+	LPSymbol *table = LPSymbolTable(self->leaf, &count);
+	
+	if (!table) {
+		return false;
+	}
+	
+	void *handle = dlopen(NULL, RTLD_LAZY);
+	LPDladdrFunc dladdr_func = handle ? (LPDladdrFunc) dlsym(handle, "dladdr") : NULL;
+	bool ok = true;
+	
+	pthread_mutex_lock(&self->lock);
+	
+	LPLine *lines = malloc((self->stack_count + 1) * sizeof *lines);
+	size_t line_count = 0;
+	
+	if (!lines) {
+		ok = false;
+	}
+	
+	for (size_t i = 0; ok && i < self->stack_count; i++) {
+		lines[line_count].text = LPStackText(self, &self->stacks[i], table, count, dladdr_func);
+		lines[line_count].count = self->stacks[i].count;
+		
+		if (!lines[line_count].text) {
+			ok = false;
+			break;
+		}
+		
+		line_count++;
+	}
+	
+	pthread_mutex_unlock(&self->lock);
+	
+	if (handle) {
+		dlclose(handle);
+	}
+	
+	free(table);
+	
+	if (ok) {
+		qsort(lines, line_count, sizeof *lines, LPLineCompare);
+		
+		for (size_t i = 0; i < line_count;) {
+			size_t j = i + 1;
+			uint64_t total = lines[i].count;
+			
+			for (; j < line_count && !strcmp(lines[i].text, lines[j].text); j++) {
+				total += lines[j].count;
+			}
+			
+			fprintf(out, "%s %" PRIu64 "\n", lines[i].text, total);
+			i = j;
+		}
+		
+		ok = !ferror(out);
+	}
+	
+	for (size_t i = 0; i < line_count; i++) {
+		free(lines[i].text);
+	}
+	
+	free(lines);
+	
+	return ok;
+}
+
+#endif // LEAFPROF_IMPLEMENTATION
+#endif // _LEAFPROF_HEADER
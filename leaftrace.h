@@ -0,0 +1,489 @@
+/**
+ * LeafTrace - function call tracer built on LeafHook
+ *
+ * *****************************************************************************
+ *
+ * Usage:
+ *
+ *  - Include leafhook.h first, then define `LEAFTRACE_IMPLEMENTATION` in one
+ *    file
+ *  - Create a tracer using a hooker (`LTTracerCreate()`)
+ *  - Add the functions to trace (`LTTracerAdd()`), optionally only recording
+ *    one in every n calls to them
+ *  - `LTTracerStart()` with a file to write the trace to, `LTTracerStop()`
+ *  - Open the file in chrome://tracing, Perfetto or speedscope
+ *
+ * Each traced call is written as one complete event to a ring owned by the
+ * calling thread, so threads never contend with each other. A background
+ * thread drains the rings to the file while tracing. `LTSetEnabled(false)`
+ * turns off tracing in every tracer at once; traced functions then only pay
+ * for checking the flag.
+ *
+ * Works where LHHookerWrap() does (AArch64 and x86-64). Calls that are traced
+ * return through LeafHook's shadow stack, so they should not be unwound by
+ * exceptions or longjmp.
+ */
+
+#ifndef _LEAFTRACE_HEADER
+#define _LEAFTRACE_HEADER
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#ifndef _LEAFHOOK_HEADER
+#error "Include leafhook.h before leaftrace.h"
+#endif
+
+// Events each thread can have waiting to be written, a power of two
+#define LT_RING_SIZE 4096
+
+// How often the rings are drained, in milliseconds
+#define LT_DRAIN_INTERVAL 50
+
+// Tracers whose rings each thread keeps track of. A thread that records
+// calls for more than this many replaces its oldest ring.
+#define LT_THREAD_TRACERS 8
+
+typedef struct LTTracer LTTracer;
+
+typedef struct LTFunction {
+	LTTracer *tracer;
+	void *function;
+	const char *name;
+	uint32_t sample_rate; // Record one in this many calls, 0 records none
+	uint64_t calls;       // Only accessed atomically
+} LTFunction;
+
+typedef struct LTEvent {
+	uint64_t start;
+	uint64_t end;
+	LTFunction *function;
+} LTEvent;
+
+typedef struct LTThread LTThread;
+
+struct LTTracer {
+	LHHooker *hooker;
+	uint64_t id; // Tells threads' rings apart from other tracers'
+	LTFunction **functions;
+	size_t function_count;
+	pthread_mutex_t lock; // Protects threads and writing
+	LTThread *threads;
+	FILE *out;
+	bool first_event;
+	bool running; // Only accessed atomically
+	bool drain_stop; // Only accessed atomically
+	pthread_t drain;
+	uint64_t base_cycles; // Timestamps are written relative to this
+	double ns_per_cycle;
+	uint64_t events;  // Total written
+	uint64_t dropped; // Lost because a ring was full
+};
+
+void LTSetEnabled(bool enabled);
+LTTracer *LTTracerCreate(LHHooker *hooker);
+void LTTracerRelease(LTTracer *self);
+bool LTTracerAdd(LTTracer *self, void *function, const char *name, uint32_t sample_rate);
+bool LTTracerSetSampleRate(LTTracer *self, void *function, uint32_t sample_rate);
+bool LTTracerStart(LTTracer *self, FILE *out);
+void LTTracerStop(LTTracer *self);
+
+#ifdef LEAFTRACE_IMPLEMENTATION
+
+struct LTThread {
+	LTThread *next;
+	pid_t tid;
+	uint32_t head; // Written by the traced thread
+	uint32_t tail; // Written by the drain
+	uint64_t dropped; // Only accessed atomically
+	LTEvent events[LT_RING_SIZE];
+};
+
+// Global kill switch, checked on every call to a traced function
+static bool gLTEnabled = true;
+
+// Source of tracer ids, 0 is never used
+static uint64_t gLTNextId;
+
+// Rings of the calling thread and the ids of the tracers they belong to
+typedef struct LTThreadRing {
+	uint64_t tracer;
+	LTThread *thread;
+} LTThreadRing;
+
+static __thread LTThreadRing tLTRings[LT_THREAD_TRACERS];
+static __thread size_t tLTNextRing;
+
+void LTSetEnabled(bool enabled) {
+	/**
+	 * Turn tracing on or off for every tracer. Calls already being traced
+	 * are still recorded when they return.
+	 */
+	
+	__atomic_store_n(&gLTEnabled, enabled, __ATOMIC_RELAXED);
+}
+
+static void LTCalibrate(LTTracer *self) {
+	/**
+	 * Find how long a tick of LHReadCycles() is, so events can be written in
+	 * microseconds
+	 */
+
+#if defined(__aarch64__)
+	uint64_t frequency;
+	__asm__ volatile ("mrs %0, cntfrq_el0" : "=r" (frequency));
+	self->ns_per_cycle = 1e9 / frequency;
+	self->base_cycles = LHReadCycles();
+#elif defined(__x86_64__)
+	struct timespec start, end, interval = {0, 10000000};
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t start_cycles = LHReadCycles();
+	nanosleep(&interval, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t end_cycles = LHReadCycles();
+	
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	self->ns_per_cycle = ns / (end_cycles - start_cycles);
+	self->base_cycles = end_cycles;
+#else
+	self->ns_per_cycle = 1.0;
+	self->base_cycles = LHReadCycles();
+#endif
+}
+
+LTTracer *LTTracerCreate(LHHooker *hooker) {
+	/**
+	 * Create a tracer that hooks functions using `hooker`
+	 */
+	
+	LTTracer *self = malloc(sizeof *self);
+	
+	if (!self) {
+		return NULL;
+	}
+	
+	memset(self, 0, sizeof *self);
+	
+	self->hooker = hooker;
+	self->id = __atomic_add_fetch(&gLTNextId, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&self->lock, NULL);
+	LTCalibrate(self);
+	
+	return self;
+}
+
+static LTThread *LTTracerFindThread(LTTracer *self) {
+	/**
+	 * Get the calling thread's ring for this tracer, if it has one
+	 */
+	
+	for (size_t i = 0; i < LT_THREAD_TRACERS; i++) {
+		if (tLTRings[i].tracer == self->id) {
+			return tLTRings[i].thread;
+		}
+	}
+	
+	return NULL;
+}
+
+static LTThread *LTTracerThread(LTTracer *self) {
+	/**
+	 * Get the calling thread's ring for this tracer, making it on the first
+	 * call that is recorded. The tracer keeps rings that get replaced in the
+	 * thread's table, so their events are still written.
+	 */
+	
+	LTThread *thread = LTTracerFindThread(self);
+	
+	if (thread) {
+		return thread;
+	}
+	
+	thread = calloc(1, sizeof *thread);
+	
+	if (!thread) {
+		return NULL;
+	}
+	
+	thread->tid = syscall(SYS_gettid);
+	
+	pthread_mutex_lock(&self->lock);
+	thread->next = self->threads;
+	self->threads = thread;
+	pthread_mutex_unlock(&self->lock);
+	
+	LTThreadRing *ring = &tLTRings[tLTNextRing++ % LT_THREAD_TRACERS];
+	ring->tracer = self->id;
+	ring->thread = thread;
+	
+	return thread;
+}
+
+static bool LTFunctionEnter(void *data) {
+	LTFunction *function = data;
+	uint32_t rate = __atomic_load_n(&function->sample_rate, __ATOMIC_RELAXED);
+	
+	if (!__atomic_load_n(&gLTEnabled, __ATOMIC_RELAXED) || !__atomic_load_n(&function->tracer->running, __ATOMIC_RELAXED) || !rate) {
+		return false;
+	}
+	
+	if (rate != 1 && __atomic_fetch_add(&function->calls, 1, __ATOMIC_RELAXED) % rate) {
+		return false;
+	}
+	
+	// Make the ring now so that recording the call when it returns never
+	// has to allocate or lock
+	return LTTracerThread(function->tracer) != NULL;
+}
+
+static void LTFunctionExit(void *data, uint64_t start, uint64_t end) {
+	LTFunction *function = data;
+	
+	// Calls that return after LTTracerStop() would end up in the next trace
+	if (!__atomic_load_n(&function->tracer->running, __ATOMIC_RELAXED)) {
+		return;
+	}
+	
+	LTThread *thread = LTTracerFindThread(function->tracer);
+	
+	if (!thread) {
+		return;
+	}
+	
+	uint32_t head = thread->head;
+	uint32_t tail = __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE);
+	
+	if (head - tail >= LT_RING_SIZE) {
+		__atomic_fetch_add(&thread->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	
+	LTEvent *event = &thread->events[head & (LT_RING_SIZE - 1)];
+	event->start = start;
+	event->end = end;
+	event->function = function;
+	
+	__atomic_store_n(&thread->head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool LTTracerAdd(LTTracer *self, void *function, const char *name, uint32_t sample_rate) {
+	/**
+	 * Hook `function` so calls to it are traced under `name`, which has to
+	 * stay valid while the tracer is used. Only one in every `sample_rate`
+	 * calls is recorded.
+	 */
+	
+	LTFunction **list = realloc(self->functions, (self->function_count + 1) * sizeof *list);
+	
+	if (!list) {
+		return false;
+	}
+	
+	self->functions = list;
+	
+	LTFunction *entry = calloc(1, sizeof *entry);
+	
+	if (!entry) {
+		return false;
+	}
+	
+	entry->tracer = self;
+	entry->function = function;
+	entry->name = name;
+	entry->sample_rate = sample_rate;
+	
+	if (!LHHookerWrap(self->hooker, function, LTFunctionEnter, LTFunctionExit, entry)) {
+		free(entry);
+		return false;
+	}
+	
+	self->functions[self->function_count++] = entry;
+	
+	return true;
+}
+
+bool LTTracerSetSampleRate(LTTracer *self, void *function, uint32_t sample_rate) {
+	/**
+	 * Change how many calls to a traced function go into each recorded one,
+	 * 0 stops recording it
+	 */
+	
+	for (size_t i = 0; i < self->function_count; i++) {
+		if (self->functions[i]->function == function) {
+			__atomic_store_n(&self->functions[i]->sample_rate, sample_rate, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static void LTWriteString(FILE *out, const char *string) {
+	/**
+	 * Write a JSON string
+	 */
+	
+	fputc('"', out);
+	
+	for (; *string; string++) {
+		unsigned char c = *string;
+		
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		}
+		else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		}
+		else {
+			fputc(c, out);
+		}
+	}
+	
+	fputc('"', out);
+}
+
+static void LTTracerDrain(LTTracer *self) {
+	/**
+	 * Write every event waiting in the threads' rings to the trace file
+	 */
+	
+	pthread_mutex_lock(&self->lock);
+	
+	int pid = getpid();
+	
+	for (LTThread *thread = self->threads; thread; thread = thread->next) {
+		uint32_t head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = thread->tail;
+		
+		for (; tail != head; tail++) {
+			LTEvent *event = &thread->events[tail & (LT_RING_SIZE - 1)];
+			
+			// Calls that started before calibration are clamped to it
+			double start = event->start > self->base_cycles ? (event->start - self->base_cycles) * self->ns_per_cycle : 0.0;
+			double duration = (event->end - event->start) * self->ns_per_cycle;
+			
+			fputs(self->first_event ? "\n" : ",\n", self->out);
+			fputs("{\"name\":", self->out);
+			LTWriteString(self->out, event->function->name);
+			fprintf(self->out, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", start / 1000.0, duration / 1000.0, pid, (int) thread->tid);
+			
+			self->first_event = false;
+			self->events++;
+		}
+		
+		__atomic_store_n(&thread->tail, tail, __ATOMIC_RELEASE);
+		self->dropped += __atomic_exchange_n(&thread->dropped, 0, __ATOMIC_RELAXED);
+	}
+	
+	fflush(self->out);
+	
+	pthread_mutex_unlock(&self->lock);
+}
+
+static void *LTDrainThread(void *arg) {
+	LTTracer *self = arg;
+	struct timespec interval = {0, LT_DRAIN_INTERVAL * 1000000};
+	
+	while (!__atomic_load_n(&self->drain_stop, __ATOMIC_RELAXED)) {
+		nanosleep(&interval, NULL);
+		LTTracerDrain(self);
+	}
+	
+	return NULL;
+}
+
+bool LTTracerStart(LTTracer *self, FILE *out) {
+	/**
+	 * Start recording calls to traced functions, writing them to `out` as a
+	 * Chrome trace event JSON array
+	 */
+	
+	if (__atomic_load_n(&self->running, __ATOMIC_RELAXED)) {
+		return false;
+	}
+	
+	self->out = out;
+	self->first_event = true;
+	fputs("[", out);
+	
+	// Throw away anything that was recorded as the last trace stopped
+	pthread_mutex_lock(&self->lock);
+	
+	for (LTThread *thread = self->threads; thread; thread = thread->next) {
+		__atomic_store_n(&thread->tail, __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+		__atomic_store_n(&thread->dropped, 0, __ATOMIC_RELAXED);
+	}
+	
+	pthread_mutex_unlock(&self->lock);
+	
+	__atomic_store_n(&self->drain_stop, false, __ATOMIC_RELAXED);
+	
+	if (pthread_create(&self->drain, NULL, LTDrainThread, self)) {
+		return false;
+	}
+	
+	__atomic_store_n(&self->running, true, __ATOMIC_RELAXED);
+	
+	return true;
+}
+
+void LTTracerStop(LTTracer *self) {
+	/**
+	 * Stop recording, write out what is left and finish the file. Calls that
+	 * are still running when this is called are not written.
+	 */
+	
+	if (!__atomic_load_n(&self->running, __ATOMIC_RELAXED)) {
+		return;
+	}
+	
+	__atomic_store_n(&self->running, false, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->drain_stop, true, __ATOMIC_RELAXED);
+	pthread_join(self->drain, NULL);
+	
+	LTTracerDrain(self);
+	
+	fputs("\n]\n", self->out);
+	fflush(self->out);
+	self->out = NULL;
+}
+
+void LTTracerRelease(LTTracer *self) {
+	/**
+	 * Stop and free the tracer. The functions stay hooked, so this should
+	 * only be done along with releasing the hooker.
+	 */
+	
+	if (!self) {
+		return;
+	}
+	
+	LTTracerStop(self);
+	
+	for (LTThread *thread = self->threads; thread;) {
+		LTThread *next = thread->next;
+		free(thread);
+		thread = next;
+	}
+	
+	for (size_t i = 0; i < self->function_count; i++) {
+		free(self->functions[i]);
+	}
+	
+	// Other threads' tables can still name this tracer, but ids are never
+	// reused so those entries are never looked at again
+	for (size_t i = 0; i < LT_THREAD_TRACERS; i++) {
+		if (tLTRings[i].tracer == self->id) {
+			tLTRings[i].tracer = 0;
+			tLTRings[i].thread = NULL;
+		}
+	}
+	
+	pthread_mutex_destroy(&self->lock);
+	free(self->functions);
+	free(self);
+}
+
+#endif // LEAFTRACE_IMPLEMENTATION
+#endif // _LEAFTRACE_HEADER
@@ -1,30 +1,441 @@
+/**
+ * Hooks functions on an x86-64 Linux host and checks that the hooks run and
+ * that the originals can still be called through the trampolines.
+ *
+ *     gcc -O2 test_hooker.c -o test_hooker && ./test_hooker
+ *
+ * Exits with 1 if any check fails.
+ */
+
 #include <stdio.h>
+#define LH_X86_64
 #define LEAFHOOK_IMPLEMENTATION
 #include "leafhook.h"
 
-uint32_t gFakeInstrs[] = {
-	0, 0, 0, 0, 0, 0, 0, 0,
-};
+int gFailures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		gFailures++; \
+	} \
+} while (0)
+
+// Functions with a known prologue, so what gets relocated doesn't depend on
+// the compiler. rip_load starts with rip-relative loads that aren't lea, and
+// are out of range of the hooker's rwx block in a PIE executable.
+int rip_load(int x);
+
+__asm__ (
+	".text\n"
+	".p2align 4\n"
+	".globl rip_load\n"
+	"rip_load:\n"
+	"	movl gRipValue(%rip), %eax\n"
+	"	addl gRipValue + 4(%rip), %eax\n"
+	"	addl %edi, %eax\n"
+	"	ret\n"
+);
+
+// Prologues with relative branches that have to be retargeted from the
+// trampoline. branchy(x) = x ? x + 1 : 100 starts with a short jcc and
+// calls_out(x) = 2 * add_one(x) with a call.
+int branchy(int x);
+int calls_out(int x);
+
+__asm__ (
+	".text\n"
+	".p2align 4\n"
+	".globl branchy\n"
+	"branchy:\n"
+	"	test %edi, %edi\n"
+	"	je 1f\n"
+	"	lea 1(%rdi), %eax\n"
+	"	ret\n"
+	"1:\n"
+	"	mov $100, %eax\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl calls_out\n"
+	"calls_out:\n"
+	"	push %rbx\n"
+	"	call add_one\n"
+	"	add %eax, %eax\n"
+	"	pop %rbx\n"
+	"	ret\n"
+	".p2align 4\n"
+	"add_one:\n"
+	"	lea 1(%rdi), %eax\n"
+	"	ret\n"
+);
+
+// count_me(x) = x + 1, probe(x) = x + 1 and timed(x) = count_me(x) + probe(x),
+// each long enough for a 14 byte jump
+int count_me(int x);
+int probe(int x);
+int timed(int x);
+
+__asm__ (
+	".text\n"
+	".p2align 4\n"
+	".globl count_me\n"
+	"count_me:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	lea 1(%rdi), %eax\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	pop %rbp\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl probe\n"
+	"probe:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	lea 1(%rdi), %eax\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	pop %rbp\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl timed\n"
+	"timed:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	push %rbx\n"
+	"	sub $8, %rsp\n"
+	"	mov %edi, %ebx\n"
+	"	call count_me\n"
+	"	mov %ebx, %edi\n"
+	"	mov %eax, %ebx\n"
+	"	call probe\n"
+	"	add %ebx, %eax\n"
+	"	add $8, %rsp\n"
+	"	pop %rbx\n"
+	"	pop %rbp\n"
+	"	ret\n"
+);
+
+// outer(x) = x + 1 and inner(x) = x + 2, hooked to the same handler, and
+// ping(x) = pong(x) = x, hooked to a handler that goes back and forth
+// between them
+int outer(int x);
+int inner(int x);
+int ping(int x);
+int pong(int x);
+
+__asm__ (
+	".text\n"
+	".p2align 4\n"
+	".globl outer\n"
+	"outer:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	lea 1(%rdi), %eax\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	pop %rbp\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl inner\n"
+	"inner:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	lea 2(%rdi), %eax\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	pop %rbp\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl ping\n"
+	"ping:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	mov %edi, %eax\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	pop %rbp\n"
+	"	ret\n"
+	".p2align 4\n"
+	".globl pong\n"
+	"pong:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	mov %edi, %eax\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	pop %rbp\n"
+	"	ret\n"
+);
+
+// two() = 2.0L, returned in st0
+long double two(void);
+
+__asm__ (
+	".text\n"
+	".p2align 4\n"
+	".globl two\n"
+	"two:\n"
+	"	push %rbp\n"
+	"	mov %rsp, %rbp\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	nopl 0(%rax, %rax, 1)\n"
+	"	fld1\n"
+	"	fld1\n"
+	"	faddp\n"
+	"	pop %rbp\n"
+	"	ret\n"
+);
+
+int gRipValue[2] = { 100, 20 };
+
+int (*gRipLoadOrig)(int x);
+
+int rip_load_hook(int x) {
+	return gRipLoadOrig(x) + 1000;
+}
+
+static void make_writable(void *function) {
+	/**
+	 * Functions have to be writable to be hooked
+	 */
+	
+	uintptr_t page = (uintptr_t) function & ~((uintptr_t) getpagesize() - 1);
+	mprotect((void *) page, 2 * getpagesize(), PROT_READ | PROT_WRITE | PROT_EXEC);
+}
+
+int (*gBranchyOrig)(int x);
+int (*gCallsOutOrig)(int x);
+
+int branchy_hook(int x) {
+	return gBranchyOrig(x) + 1000;
+}
+
+int calls_out_hook(int x) {
+	return gCallsOutOrig(x) + 1000;
+}
+
+static void test_relative_branches(LHHooker *hooker) {
+	int (*volatile call_branchy)(int) = branchy;
+	int (*volatile call_calls_out)(int) = calls_out;
+	uint8_t *code = (uint8_t *) branchy;
+	
+	make_writable(branchy);
+	
+	CHECK(LHHookerHookFunction(hooker, branchy, branchy_hook, (void **) &gBranchyOrig));
+	CHECK(LHHookerHookFunction(hooker, calls_out, calls_out_hook, (void **) &gCallsOutOrig));
+	
+	if (!gBranchyOrig || !gCallsOutOrig) {
+		return;
+	}
+	
+	// Hooks in the executable are in range of a 5 byte jmp, which splits the
+	// lea so the rest of it is int3
+	CHECK(code[0] == 0xe9);
+	CHECK(code[5] == 0xcc && code[6] == 0xcc);
+	
+	// Both ways out of the jcc, and the call, still go to the right places
+	CHECK(call_branchy(5) == 1006);
+	CHECK(call_branchy(0) == 1100);
+	CHECK(gBranchyOrig(5) == 6);
+	CHECK(gBranchyOrig(0) == 100);
+	CHECK(call_calls_out(4) == 1010);
+	CHECK(gCallsOutOrig(4) == 10);
+}
+
+static void test_rip_relative(LHHooker *hooker) {
+	int (*volatile call)(int) = rip_load;
+	
+	make_writable(rip_load);
+	
+	CHECK(LHHookerHookFunction(hooker, rip_load, rip_load_hook, (void **) &gRipLoadOrig));
+	
+	if (!gRipLoadOrig) {
+		return;
+	}
+	
+	CHECK(call(3) == 1123);
+	CHECK(gRipLoadOrig(3) == 123);
+	
+	// The trampoline has to read the variable, not a copy of it
+	gRipValue[0] = 200;
+	CHECK(gRipLoadOrig(3) == 223);
+}
+
+size_t gProbeEnterDepth, gProbeExitDepth;
+
+bool probe_enter(void *data) {
+	gProbeEnterDepth = gLHShadowDepth;
+	return true;
+}
+
+void probe_exit(void *data, uint64_t start, uint64_t end) {
+	gProbeExitDepth = gLHShadowDepth;
+}
+
+bool x87_enter(void *data) {
+	return true;
+}
+
+void x87_exit(void *data, uint64_t start, uint64_t end) {
+	// Functions can use all eight x87 registers
+	__asm__ volatile (
+		"fldz\n fldz\n fldz\n fldz\n fldz\n fldz\n fldz\n fldz\n"
+		"fstp %%st(0)\n fstp %%st(0)\n fstp %%st(0)\n fstp %%st(0)\n"
+		"fstp %%st(0)\n fstp %%st(0)\n fstp %%st(0)\n fstp %%st(0)\n"
+		::: "st", "st(1)", "st(2)", "st(3)", "st(4)", "st(5)", "st(6)", "st(7)"
+	);
+}
+
+static void test_x87_return(LHHooker *hooker) {
+	long double (*volatile call)(void) = two;
+	
+	make_writable(two);
+	
+	CHECK(LHHookerWrap(hooker, two, x87_enter, x87_exit, NULL));
+	
+	// More calls than there are x87 registers, so any value left behind
+	// would overflow the stack
+	for (int i = 0; i < 10; i++) {
+		CHECK(call() == 2.0L);
+	}
+}
+
+int (*volatile gInner)(int x) = inner;
+size_t gContextMismatches;
+
+int context_handler(int x) {
+	LHContext *caller;
+	LHContext *context = LHHookerEnterContext(&caller);
+	int result = ((int (*)(int)) context->orig)(x);
+	
+	// The outer handler goes through the inner hook too
+	if (context->function == (void *) outer) {
+		result += gInner(x);
+	}
+	
+	// Which has put this handler's context back by now
+	if (LHHookerCurrentContext() != context) {
+		gContextMismatches++;
+	}
+	
+	LHHookerLeaveContext(caller);
+	
+	return result * 10;
+}
+
+int (*volatile gPing)(int x) = ping;
+int (*volatile gPong)(int x) = pong;
+
+int ping_pong_handler(int x) {
+	LHContext *caller;
+	LHContext *context = LHHookerEnterContext(&caller);
+	int (*other)(int) = context->function == (void *) ping ? gPong : gPing;
+	int result;
+	
+	if ((intptr_t) context->user_data != (context->function == (void *) ping ? 1 : 2)) {
+		gContextMismatches++;
+	}
+	
+	result = x ? other(x - 1) + 1 : ((int (*)(int)) context->orig)(x);
+	
+	if (LHHookerCurrentContext() != context) {
+		gContextMismatches++;
+	}
+	
+	LHHookerLeaveContext(caller);
+	
+	return result;
+}
 
-uint32_t gCoolTest;
+static void test_nested_context(LHHooker *hooker) {
+	int (*volatile call)(int) = outer;
+	
+	make_writable(outer);
+	
+	CHECK(LHHookerHookWithContext(hooker, outer, context_handler, NULL, NULL));
+	CHECK(LHHookerHookWithContext(hooker, inner, context_handler, NULL, NULL));
+	
+	// inner(1) = 30 through its hook, outer(1) = (2 + 30) * 10
+	CHECK(gInner(1) == 30);
+	CHECK(call(1) == 320);
+	CHECK(gContextMismatches == 0);
+	CHECK(LHHookerCurrentContext() == NULL);
+	
+	// Far deeper than the shadow stack, contexts are kept in the handlers'
+	// frames
+	make_writable(ping);
+	
+	CHECK(LHHookerHookWithContext(hooker, ping, ping_pong_handler, (void *) 1, NULL));
+	CHECK(LHHookerHookWithContext(hooker, pong, ping_pong_handler, (void *) 2, NULL));
+	
+	CHECK(gPing(1001) == 1001);
+	CHECK(gContextMismatches == 0);
+	CHECK(LHHookerCurrentContext() == NULL);
+	CHECK(gLHShadowDepth == 0);
+}
 
-void dump_bytes(const char *title, uint8_t *data, size_t size) {
-	printf("## %s <%p> (%zu) ##\n", title, data, size);
+static void test_instrument(LHHooker *hooker) {
+	int (*volatile call)(int) = timed;
+	LHCounters counters[2] = {0};
+	LHCounters snapshot[2];
 	
-	for (size_t i = 0; i < size; i += 4) {
-		printf("%02x %02x %02x %02x\n", data[i], data[i+1], data[i+2], data[i+3]);
+	make_writable(count_me);
+	counters[1].latency = true;
+	
+	CHECK(LHHookerInstrument(hooker, count_me, &counters[0]));
+	CHECK(LHHookerInstrument(hooker, timed, &counters[1]));
+	CHECK(LHHookerWrap(hooker, probe, probe_enter, probe_exit, NULL));
+	
+	// Thunks are in the hooker's rwx block, which is usually too far away
+	// for a 5 byte jmp
+	bool far = !LHX86InRel32((intptr_t) count_me + 5, (intptr_t) hooker->rwx_block);
+	CHECK(*(uint8_t *) count_me == (far ? 0xff : 0xe9));
+	
+	for (int i = 0; i < 10; i++) {
+		CHECK(call(i) == 2 * i + 2);
 	}
 	
-	printf("\n");
+	// Timed calls have returned through the shadow stack, and probe() was
+	// called with timed()'s frame on it
+	CHECK(gLHShadowDepth == 0);
+	CHECK(gProbeEnterDepth == 1);
+	CHECK(gProbeExitDepth == 1);
+	
+	CHECK(LHHookerSnapshotCounters(hooker, snapshot, 2, true) == 2);
+	CHECK(snapshot[0].function == count_me);
+	CHECK(snapshot[0].calls == 10);
+	CHECK(snapshot[1].function == timed);
+	CHECK(snapshot[1].calls == 10);
+	CHECK(snapshot[1].cycles > 0);
+	
+	uint64_t timed_calls = 0;
+	
+	for (size_t i = 0; i < LH_HISTOGRAM_BUCKETS; i++) {
+		timed_calls += snapshot[1].histogram[i];
+	}
+	
+	CHECK(timed_calls == 10);
+	
+	// The snapshot reset them
+	LHHookerSnapshotCounters(hooker, snapshot, 2, false);
+	CHECK(snapshot[0].calls == 0);
+	CHECK(snapshot[1].calls == 0);
+	CHECK(snapshot[1].cycles == 0);
 }
 
-int main(int argc, const char *argv[]) {
+int main(void) {
 	LHHooker *hooker = LHHookerCreate();
-	void *orig;
-	LHHookerHookFunction(hooker, gFakeInstrs, &gCoolTest, &orig);
 	
-	dump_bytes("function", (uint8_t *) gFakeInstrs, 16);
-	dump_bytes("callback", orig, 28);
+	test_rip_relative(hooker);
+	test_relative_branches(hooker);
+	test_instrument(hooker);
+	test_x87_return(hooker);
+	test_nested_context(hooker);
 	
 	LHHookerRelease(hooker);
+	
+	printf("%s\n", gFailures ? "failed" : "passed");
+	
+	return gFailures ? 1 : 0;
 }
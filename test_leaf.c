@@ -0,0 +1,894 @@
+/**
+ * Loads a small library with Leaf and checks IFUNC lookups, import overrides,
+ * rebinding, containers, embedded images, lazy loading, page profiles,
+ * inspection, loading on another thread, deferred initializers, thread locals,
+ * unwinding and instances of templates.
+ * The library is this file built with TEST_LIBRARY defined, and it is also
+ * embedded in the test, so build it first:
+ *
+ *     gcc -shared -fPIC -DTEST_LIBRARY test_leaf.c -o test_leaf.so
+ *     gcc test_leaf.c -o test_leaf && ./test_leaf ./test_leaf.so
+ *
+ * Exits with 1 if any check fails.
+ */
+
+#ifdef TEST_LIBRARY
+
+#include <stdlib.h>
+#include <pthread.h>
+
+// How many times the constructor has run, and on which thread it last did
+int init_runs;
+pthread_t init_thread;
+
+__attribute__((constructor)) static void count_init(void) {
+	init_runs++;
+	init_thread = pthread_self();
+}
+
+// Calls atoi() through the PLT
+int parse(const char *s) {
+	return atoi(s);
+}
+
+// An IFUNC that nothing in the library refers to, so only a lookup can
+// resolve it
+int resolver_runs;
+
+static int ifunc_impl(void) {
+	return 111;
+}
+
+static int (*resolve_ifunc(void))(void) {
+	resolver_runs++;
+	return ifunc_impl;
+}
+
+int ifunc(void) __attribute__((ifunc("resolve_ifunc")));
+
+// A thread local with an initial value, which makes its block dynamic.
+// test_leaf also loads a copy with the value zeroed, which goes in static TLS.
+__thread int tls_value = 7;
+
+// With -fPIC this goes through __tls_get_addr on x86-64 and a TLS
+// descriptor on AArch64
+int *tls_addr(void) {
+	return &tls_value;
+}
+
+int *tls_desc_addr(void) {
+#if defined(__x86_64__)
+	int *addr;
+	
+	__asm__ (
+		"lea tls_value@TLSDESC(%%rip), %%rax\n"
+		"call *tls_value@TLSCALL(%%rax)\n"
+		"add %%fs:0, %%rax\n"
+		: "=a" (addr) :: "cc", "memory"
+	);
+	
+	return addr;
+#else
+	return &tls_value;
+#endif
+}
+
+// Each instance of a template has its own
+int counter;
+
+int bump(void) {
+	return ++counter;
+}
+
+// Calls back into the test, which unwinds through this frame
+int call_back(int (*callback)(int x), int x) {
+	return callback(x) + 1;
+}
+
+// A page of data that nothing touches while loading
+int lazy_page[1024] __attribute__((aligned(4096))) = {42};
+
+#else
+
+#include <stdio.h>
+#include <time.h>
+#include <execinfo.h>
+#define LEAF_IMPLEMENTATION
+#include "leaf.h"
+
+int gFailures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		gFailures++; \
+	} \
+} while (0)
+
+// The library, page aligned in its own section like tools/f2incbin.py does it
+__asm__ (
+	".pushsection .leaf.gTestLeafData, \"a\"\n"
+	".balign 4096\n"
+	"gTestLeafData:\n"
+	".incbin \"test_leaf.so\"\n"
+	"gTestLeafDataEnd:\n"
+	".popsection\n"
+);
+
+extern const uint8_t gTestLeafData[];
+extern const uint8_t gTestLeafDataEnd[];
+
+int fake_atoi(const char *s) {
+	return 1000;
+}
+
+int other_atoi(const char *s) {
+	return 2000;
+}
+
+static Leaf *load(const char *path, uint32_t flags, const LeafImport *imports, size_t import_count) {
+	Leaf *leaf = LeafInit();
+	LeafSetFlags(leaf, flags);
+	LeafSetImportOverrides(leaf, imports, import_count);
+	
+	const char *error = LeafLoadFromFile(leaf, path);
+	
+	if (error) {
+		printf("FAIL loading %s: %s\n", path, error);
+		gFailures++;
+		LeafFree(leaf);
+		return NULL;
+	}
+	
+	return leaf;
+}
+
+static void test_ifunc(const char *path) {
+	Leaf *leaf = load(path, 0, NULL, 0);
+	
+	if (!leaf) {
+		return;
+	}
+	
+	const char *names[] = {"ifunc"};
+	int (*batch[1])(void);
+	int (*ifunc)(void) = LeafSymbolAddr(leaf, "ifunc");
+	int (*hashed)(void) = LeafSymbolAddrHashed(leaf, LEAF_SYM("ifunc"));
+	int *runs = LeafSymbolAddr(leaf, "resolver_runs");
+	
+	CHECK(LeafSymbolAddrBatch(leaf, names, (void **) batch, 1) == 1);
+	CHECK(ifunc && ifunc() == 111);
+	CHECK(hashed == ifunc);
+	CHECK(batch[0] == ifunc);
+	
+	// Lookups after the first one use what the resolver returned
+	CHECK(runs && *runs == 1);
+	
+	LeafFree(leaf);
+}
+
+static void test_overrides(const char *path) {
+	LeafImport imports[] = {
+		{"atoi", fake_atoi},
+	};
+	
+	Leaf *leaf = load(path, 0, imports, 1);
+	
+	if (!leaf) {
+		return;
+	}
+	
+	int (*parse)(const char *s) = LeafSymbolAddr(leaf, "parse");
+	CHECK(parse && parse("5") == 1000);
+	
+	LeafFree(leaf);
+}
+
+static void test_rebind(const char *path, uint32_t flags) {
+	Leaf *leaf = load(path, flags, NULL, 0);
+	
+	if (!leaf) {
+		return;
+	}
+	
+	int (*parse)(const char *s) = LeafSymbolAddr(leaf, "parse");
+	void *old;
+	
+	CHECK(parse && parse("5") == 5);
+	
+	if (!parse) {
+		LeafFree(leaf);
+		return;
+	}
+
+#if defined(__x86_64__)
+	// libc is in range of the library's stub, so it stays a direct branch
+	// while being pointed somewhere else in libc
+	if (flags & LEAF_DIRECT_PLT) {
+		LeafPltPatch *patch = NULL;
+		
+		for (size_t i = 0; i < leaf->plt_patch_count; i++) {
+			if (!strcmp(leaf->strtab + leaf->symtab[leaf->plt_patches[i].sym_index].st_name, "atoi")) {
+				patch = &leaf->plt_patches[i];
+			}
+		}
+		
+		CHECK(patch && patch->stub[0] == 0xe9);
+		CHECK(LeafRebindImport(leaf, "atoi", (void *) atol, NULL) == NULL);
+		CHECK(patch && patch->stub[0] == 0xe9);
+		CHECK(parse("5") == 5);
+		CHECK(LeafRebindImport(leaf, "atoi", (void *) atoi, NULL) == NULL);
+	}
+#endif
+
+	// The executable usually isn't in range, so on x86-64 a direct stub goes
+	// back to loading from the GOT. Elsewhere that can't be done safely while
+	// the library runs, so rebinding is refused.
+	const char *error = LeafRebindImport(leaf, "atoi", other_atoi, &old);
+
+#if !defined(__x86_64__)
+	if (error && (flags & LEAF_DIRECT_PLT)) {
+		LeafFree(leaf);
+		return;
+	}
+#endif
+
+	CHECK(error == NULL);
+	CHECK(old == (void *) atoi);
+	CHECK(parse("5") == 2000);
+	
+	CHECK(LeafRebindImport(leaf, "atoi", old, NULL) == NULL);
+	CHECK(parse("5") == 5);
+	
+	CHECK(LeafRebindImport(leaf, "not_imported", other_atoi, NULL) != NULL);
+	
+	LeafFree(leaf);
+}
+
+static void test_lazy(const char *path) {
+	Leaf *leaf = load(path, LEAF_LAZY, NULL, 0);
+	
+	if (!leaf) {
+		return;
+	}
+	
+	// Without userfaultfd everything was loaded up front, which still has to
+	// work
+	if (!leaf->lazy) {
+		printf("userfaultfd is not available, testing a normal load\n");
+	}
+	
+	int *lazy_page = LeafSymbolAddr(leaf, "lazy_page");
+	size_t page = lazy_page ? ((uint8_t *) lazy_page - (uint8_t *) leaf->blob) / getpagesize() : 0;
+	
+	CHECK(lazy_page != NULL);
+	
+	if (leaf->lazy && lazy_page) {
+		CHECK(!leaf->lazy->present[page]);
+	}
+	
+	int (*parse)(const char *s) = LeafSymbolAddr(leaf, "parse");
+	int (*ifunc)(void) = LeafSymbolAddr(leaf, "ifunc");
+	
+	CHECK(parse && parse("5") == 5);
+	CHECK(ifunc && ifunc() == 111);
+	CHECK(lazy_page && lazy_page[0] == 42 && lazy_page[1] == 0);
+	
+	if (leaf->lazy && lazy_page) {
+		CHECK(leaf->lazy->present[page]);
+	}
+	
+	LeafFree(leaf);
+}
+
+typedef struct Progress {
+	LeafPhase phases[16];
+	size_t count;
+} Progress;
+
+static void record_phase(Leaf *leaf, LeafPhase phase, void *user) {
+	Progress *progress = user;
+	
+	if (progress->count < 16) {
+		progress->phases[progress->count++] = phase;
+	}
+}
+
+static void test_async(const char *path, uint32_t flags) {
+	Leaf *leaf = LeafInit();
+	Progress progress = {0};
+	
+	LeafSetFlags(leaf, flags);
+	LeafSetProgress(leaf, record_phase, &progress);
+	
+	LeafAsync *job = LeafLoadAsync(leaf, path);
+	
+	CHECK(job != NULL);
+	
+	if (!job) {
+		LeafFree(leaf);
+		return;
+	}
+	
+	while (LeafPoll(job) != LEAF_PHASE_DONE) {
+		nanosleep(&(struct timespec) {0, 100000}, NULL);
+	}
+	
+	CHECK(LeafWait(job) == NULL);
+	
+	// Every phase was reported once, in order
+	CHECK(progress.count == LEAF_PHASE_DONE + 1);
+	
+	for (size_t i = 0; i < progress.count; i++) {
+		CHECK(progress.phases[i] == (LeafPhase) i);
+	}
+	
+	int (*parse)(const char *s) = LeafSymbolAddr(leaf, "parse");
+	int *init_runs = LeafSymbolAddr(leaf, "init_runs");
+	pthread_t *init_thread = LeafSymbolAddr(leaf, "init_thread");
+	
+	CHECK(parse && parse("5") == 5);
+	CHECK(init_runs && *init_runs == 1);
+	
+	// Deferred initializers run in LeafWait()
+	if (init_thread) {
+		CHECK(pthread_equal(*init_thread, pthread_self()) == !!(flags & LEAF_DEFER_INIT));
+	}
+	
+	LeafFree(leaf);
+	
+	// Errors come back from LeafWait() too
+	leaf = LeafInit();
+	job = LeafLoadAsync(leaf, "/nonexistent/test_leaf.so");
+	CHECK(job && LeafWait(job) != NULL);
+	LeafFree(leaf);
+}
+
+void *gFrames[64];
+int gFrameCount;
+
+int record_backtrace(int x) {
+	gFrameCount = backtrace(gFrames, 64);
+	return x;
+}
+
+static int find_image(struct dl_phdr_info *info, size_t size, void *data) {
+	return ((LeafPhdrInfo *) info)->addr == (size_t) data;
+}
+
+static void test_unwind(const char *path) {
+	Leaf *leaf = load(path, 0, NULL, 0);
+	
+	if (!leaf) {
+		return;
+	}
+	
+	int (*call_back)(int (*callback)(int x), int x) = LeafSymbolAddr(leaf, "call_back");
+	
+	CHECK(call_back && call_back(record_backtrace, 1) == 2);
+	
+	// The unwinder found the library's frame and carried on into ours
+	uint8_t *start = leaf->blob;
+	uint8_t *end = start + leaf->blob_length;
+	int in_library = -1;
+	
+	for (int i = 0; i < gFrameCount && in_library < 0; i++) {
+		if ((uint8_t *) gFrames[i] >= start && (uint8_t *) gFrames[i] < end) {
+			in_library = i;
+		}
+	}
+	
+	CHECK(in_library > 0);
+	CHECK(in_library + 1 < gFrameCount);
+	
+	// It is listed for unwinders that search program headers until it is
+	// freed
+	CHECK(LeafIteratePhdr(find_image, leaf->blob) == 1);
+	
+	LeafFree(leaf);
+	
+	CHECK(LeafIteratePhdr(find_image, start) == 0);
+}
+
+static void *run_initializers(void *arg) {
+	LeafRunInitializers(arg);
+	return NULL;
+}
+
+static void test_deferred_init(const char *path) {
+	Leaf *leaf = load(path, LEAF_DEFER_INIT, NULL, 0);
+	
+	if (!leaf) {
+		return;
+	}
+	
+	int *init_runs = LeafSymbolAddr(leaf, "init_runs");
+	
+	CHECK(init_runs && *init_runs == 0);
+	CHECK(leaf->init_state == LEAF_INIT_PENDING);
+	
+	// Only one of the threads runs them, the rest wait for it
+	pthread_t threads[4];
+	
+	for (int i = 0; i < 4; i++) {
+		CHECK(pthread_create(&threads[i], NULL, run_initializers, leaf) == 0);
+	}
+	
+	for (int i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	
+	CHECK(init_runs && *init_runs == 1);
+	CHECK(leaf->init_state == LEAF_INIT_DONE);
+	
+	CHECK(LeafSymbolAddrInitialized(leaf, "init_runs") == init_runs);
+	CHECK(init_runs && *init_runs == 1);
+	
+	LeafFree(leaf);
+	
+	// The first lookup that needs them runs them
+	leaf = load(path, LEAF_DEFER_INIT, NULL, 0);
+	
+	if (leaf) {
+		init_runs = LeafSymbolAddrInitialized(leaf, "init_runs");
+		CHECK(init_runs && *init_runs == 1);
+		LeafFree(leaf);
+	}
+}
+
+static uint8_t *read_file(const char *path, size_t *length) {
+	FILE *file = fopen(path, "rb");
+	
+	if (!file) {
+		return NULL;
+	}
+	
+	fseek(file, 0, SEEK_END);
+	*length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	
+	uint8_t *data = malloc(*length);
+	
+	if (data && fread(data, 1, *length, file) != *length) {
+		free(data);
+		data = NULL;
+	}
+	
+	fclose(file);
+	
+	return data;
+}
+
+static void test_profile(const char *path) {
+	Leaf *leaf = load(path, LEAF_PROFILE_RECORD, NULL, 0);
+	
+	if (!leaf) {
+		return;
+	}
+	
+	// Recording needs userfaultfd
+	if (!leaf->lazy || !leaf->profile_path) {
+		printf("userfaultfd is not available, not testing profiles\n");
+		LeafFree(leaf);
+		return;
+	}
+	
+	int (*parse)(const char *s) = LeafSymbolAddr(leaf, "parse");
+	int *lazy_page = LeafSymbolAddr(leaf, "lazy_page");
+	
+	CHECK(parse && parse("5") == 5);
+	CHECK(lazy_page && lazy_page[0] == 42);
+	CHECK(LeafSaveProfile(leaf) == NULL);
+	
+	char *profile = strdup(leaf->profile_path);
+	
+	LeafFree(leaf);
+	
+	CHECK(access(profile, R_OK) == 0);
+	
+	// Replaying it fills the pages that were touched while recording
+	// before anything touches them again
+	leaf = load(path, LEAF_LAZY | LEAF_PROFILE_REPLAY, NULL, 0);
+	
+	if (leaf) {
+		lazy_page = LeafSymbolAddr(leaf, "lazy_page");
+		size_t page = lazy_page ? ((uint8_t *) lazy_page - (uint8_t *) leaf->blob) / getpagesize() : 0;
+		
+		CHECK(leaf->prefetch != NULL);
+		CHECK(lazy_page != NULL);
+		
+		for (int i = 0; i < 1000 && leaf->lazy && !__atomic_load_n(&leaf->lazy->present[page], __ATOMIC_RELAXED); i++) {
+			nanosleep(&(struct timespec) {0, 1000000}, NULL);
+		}
+		
+		CHECK(leaf->lazy && leaf->lazy->present[page]);
+		CHECK(lazy_page && lazy_page[0] == 42);
+		
+		parse = LeafSymbolAddr(leaf, "parse");
+		CHECK(parse && parse("5") == 5);
+		
+		LeafFree(leaf);
+	}
+	
+	unlink(profile);
+	free(profile);
+}
+
+static void test_inspect(const char *path) {
+	size_t length;
+	uint8_t *data = read_file(path, &length);
+	LeafInspectReport report;
+	
+	if (!data) {
+		printf("FAIL reading %s\n", path);
+		gFailures++;
+		return;
+	}
+	
+	CHECK(LeafInspect(data, length, &report) == NULL);
+	CHECK(report.loadable && report.problem == NULL);
+	CHECK(report.machine == LEAF_CURRENT_MACHINE);
+	CHECK(report.segment_count >= 2);
+	CHECK(report.init_count >= 1);
+	CHECK(report.export_count > 0 && report.import_count > 0);
+	CHECK(report.unsupported_reloc_count == 0);
+	
+	bool needs_libc = false;
+	
+	for (size_t i = 0; i < report.needed_count && i < LEAF_INSPECT_MAX_NEEDED; i++) {
+		needs_libc |= !strcmp(report.needed[i], "libc.so.6");
+	}
+	
+	CHECK(needs_libc);
+	
+	// Truncated files are summarised as far as they go or refused, without
+	// reading past the end
+	CHECK(LeafInspect(data, 16, &report) != NULL);
+	
+	for (size_t cut = 64; cut < length; cut += 64) {
+		uint8_t *copy = malloc(cut);
+		memcpy(copy, data, cut);
+		LeafInspect(copy, cut, &report);
+		free(copy);
+	}
+	
+	free(data);
+}
+
+typedef struct TlsThread {
+	int *(*tls_addr)(void);
+	int *(*tls_desc_addr)(void);
+	int initial;
+	pthread_barrier_t *barrier; // Keeps the threads alive at the same time
+	int *addr;
+	bool ok;
+} TlsThread;
+
+static void *tls_thread(void *arg) {
+	TlsThread *thread = arg;
+	int *addr = thread->tls_addr();
+	
+	// Each thread starts with its own copy of the initial value
+	thread->ok = addr && addr == thread->tls_desc_addr() && *addr == thread->initial;
+	thread->addr = addr;
+	
+	if (addr) {
+		*addr = 100;
+	}
+	
+	if (thread->barrier) {
+		pthread_barrier_wait(thread->barrier);
+	}
+	
+	return NULL;
+}
+
+static void test_tls(const char *path, bool zeroed) {
+	size_t length;
+	uint8_t *data = read_file(path, &length);
+	
+	if (!data) {
+		printf("FAIL reading %s\n", path);
+		gFailures++;
+		return;
+	}
+	
+	// Zero the initial value so the block can go in static TLS
+	const LeafEhdr *ehdr = (const LeafEhdr *) data;
+	const LeafPhdr *phdrs = (const LeafPhdr *) (data + ehdr->e_phoff);
+	
+	for (size_t i = 0; zeroed && i < ehdr->e_phnum; i++) {
+		if (phdrs[i].p_type == PT_TLS) {
+			memset(data + phdrs[i].p_offset, 0, phdrs[i].p_filesz);
+		}
+	}
+	
+	Leaf *leaf = LeafInit();
+	const char *error = LeafLoadFromBuffer(leaf, data, length);
+	
+	CHECK(error == NULL);
+	
+	if (error) {
+		LeafFree(leaf);
+		free(data);
+		return;
+	}
+	
+	CHECK(leaf->tls_static == zeroed);
+	
+	TlsThread main_thread = {
+		.tls_addr = LeafSymbolAddr(leaf, "tls_addr"),
+		.tls_desc_addr = LeafSymbolAddr(leaf, "tls_desc_addr"),
+		.initial = zeroed ? 0 : 7,
+	};
+	
+	CHECK(main_thread.tls_addr && main_thread.tls_desc_addr);
+	
+	if (!main_thread.tls_addr || !main_thread.tls_desc_addr) {
+		LeafFree(leaf);
+		free(data);
+		return;
+	}
+	
+	// Symbol lookups give this thread's copy
+	CHECK(LeafSymbolAddr(leaf, "tls_value") == main_thread.tls_addr());
+	
+	tls_thread(&main_thread);
+	CHECK(main_thread.ok);
+	
+	TlsThread threads[2] = {main_thread, main_thread};
+	pthread_t ids[2];
+	pthread_barrier_t barrier;
+	
+	pthread_barrier_init(&barrier, NULL, 2);
+	threads[0].barrier = threads[1].barrier = &barrier;
+	
+	for (int i = 0; i < 2; i++) {
+		CHECK(pthread_create(&ids[i], NULL, tls_thread, &threads[i]) == 0);
+	}
+	
+	for (int i = 0; i < 2; i++) {
+		pthread_join(ids[i], NULL);
+		CHECK(threads[i].ok);
+		CHECK(threads[i].addr != main_thread.addr);
+	}
+	
+	CHECK(threads[0].addr != threads[1].addr);
+	CHECK(*main_thread.addr == 100);
+	
+	pthread_barrier_destroy(&barrier);
+	
+	LeafFree(leaf);
+	free(data);
+}
+
+static uint8_t *pack_container(const uint8_t *elf, size_t *length) {
+	/**
+	 * Same layout as tools/leafpack.py, but every PT_LOAD is one stored chunk
+	 * and there are no copies of the dynamic section or string table.
+	 */
+	
+	const LeafEhdr *ehdr = (const LeafEhdr *) elf;
+	const LeafPhdr *phdrs = (const LeafPhdr *) (elf + ehdr->e_phoff);
+	size_t elf_size = ehdr->e_phoff + ehdr->e_phnum * sizeof *phdrs;
+	LeafContainerHeader header = {.magic = "LEAFPAK", .elf_size = elf_size};
+	size_t data_size = 0;
+	
+	for (size_t i = 0; i < ehdr->e_phnum; i++) {
+		if (phdrs[i].p_type == PT_LOAD) {
+			header.chunk_count++;
+			data_size += phdrs[i].p_filesz;
+		}
+	}
+	
+	size_t offset = sizeof header + header.chunk_count * sizeof(LeafContainerChunk) + elf_size;
+	uint8_t *out = malloc(offset + data_size);
+	LeafContainerChunk *chunks = (LeafContainerChunk *) (out + sizeof header);
+	size_t chunk = 0;
+	
+	memcpy(out, &header, sizeof header);
+	memcpy(out + sizeof header + header.chunk_count * sizeof *chunks, elf, elf_size);
+	
+	for (size_t i = 0; i < ehdr->e_phnum; i++) {
+		if (phdrs[i].p_type != PT_LOAD) {
+			continue;
+		}
+		
+		chunks[chunk++] = (LeafContainerChunk) {
+			.vaddr = phdrs[i].p_vaddr,
+			.size = phdrs[i].p_filesz,
+			.packed_size = phdrs[i].p_filesz,
+			.offset = offset,
+		};
+		
+		memcpy(out + offset, elf + phdrs[i].p_offset, phdrs[i].p_filesz);
+		offset += phdrs[i].p_filesz;
+	}
+	
+	*length = offset;
+	
+	return out;
+}
+
+static const char *load_container(const uint8_t *container, size_t length) {
+	Leaf *leaf = LeafInit();
+	const char *error = LeafLoadFromContainer(leaf, container, length);
+	
+	if (!error) {
+		int (*parse)(const char *s) = LeafSymbolAddr(leaf, "parse");
+		CHECK(parse && parse("5") == 5);
+	}
+	
+	LeafFree(leaf);
+	
+	return error;
+}
+
+static void test_container(const char *path) {
+	size_t elf_length, length;
+	uint8_t *elf = read_file(path, &elf_length);
+	
+	if (!elf) {
+		printf("FAIL reading %s\n", path);
+		gFailures++;
+		return;
+	}
+	
+	uint8_t *container = pack_container(elf, &length);
+	LeafContainerChunk *chunk = (LeafContainerChunk *) (container + sizeof(LeafContainerHeader));
+	LeafContainerChunk saved = *chunk;
+	
+	CHECK(load_container(container, length) == NULL);
+	
+	// Malformed containers are refused before anything is copied, including
+	// ones where adding up the offsets would wrap around
+	CHECK(load_container(container, sizeof(LeafContainerHeader) - 1) != NULL);
+	CHECK(load_container(container, sizeof(LeafContainerHeader) + 1) != NULL);
+	
+	chunk->offset = length - chunk->packed_size + 1;
+	CHECK(load_container(container, length) != NULL);
+	
+	chunk->offset = UINT64_MAX - chunk->packed_size + 2;
+	CHECK(load_container(container, length) != NULL);
+	
+	*chunk = saved;
+	chunk->vaddr = UINT64_MAX - chunk->size + 2;
+	CHECK(load_container(container, length) != NULL);
+	
+	*chunk = saved;
+	chunk->size = UINT32_MAX;
+	CHECK(load_container(container, length) != NULL);
+	
+	free(container);
+	free(elf);
+}
+
+static void test_embedded(void) {
+	Leaf *leaf = LeafInit();
+	const char *error = LeafLoadFromEmbedded(leaf, gTestLeafData, gTestLeafDataEnd - gTestLeafData);
+	
+	CHECK(error == NULL);
+	
+	if (error) {
+		LeafFree(leaf);
+		return;
+	}
+	
+	int (*parse)(const char *s) = LeafSymbolAddr(leaf, "parse");
+	CHECK(parse && parse("5") == 5);
+	
+	// Mapped from this executable instead of copied
+	char exe[256] = {0};
+	char path[256];
+	size_t offset;
+	
+	CHECK(readlink("/proc/self/exe", exe, sizeof exe - 1) > 0);
+	CHECK(LeafFindBackingFile(leaf->blob, path, sizeof path, &offset) && !strcmp(path, exe));
+	
+	LeafFree(leaf);
+}
+
+static void test_template(const char *path) {
+	Leaf *tmpl = load(path, LEAF_TEMPLATE, NULL, 0);
+	
+	if (!tmpl) {
+		return;
+	}
+	
+	Leaf *instances[2];
+	
+	for (int i = 0; i < 2; i++) {
+		instances[i] = LeafInit();
+		CHECK(LeafInstantiate(instances[i], tmpl) == NULL);
+	}
+	
+	int (*bump)(void) = LeafSymbolAddr(tmpl, "bump");
+	int (*bump0)(void) = LeafSymbolAddr(instances[0], "bump");
+	int (*bump1)(void) = LeafSymbolAddr(instances[1], "bump");
+	int *init_runs = LeafSymbolAddr(instances[1], "init_runs");
+	
+	CHECK(bump && bump0 && bump1 && init_runs);
+	
+	if (!bump || !bump0 || !bump1 || !init_runs) {
+		LeafFree(instances[0]);
+		LeafFree(instances[1]);
+		LeafFree(tmpl);
+		return;
+	}
+	
+	// Globals and initializers are per instance
+	CHECK(bump() == 1 && bump() == 2);
+	CHECK(bump0() == 1);
+	CHECK(bump1() == 1);
+	CHECK(*init_runs == 1);
+	
+	// Code is mapped from the template's memfd, not copied
+	char path_buffer[256];
+	size_t offset;
+	
+	CHECK(LeafFindBackingFile(bump1, path_buffer, sizeof path_buffer, &offset) && strstr(path_buffer, "leaf-template"));
+	
+	// Instances outlive the template
+	LeafFree(tmpl);
+	
+	int (*parse)(const char *s) = LeafSymbolAddr(instances[0], "parse");
+	CHECK(parse && parse("5") == 5);
+	CHECK(bump0() == 2);
+	
+	LeafFree(instances[0]);
+	LeafFree(instances[1]);
+	
+	// Only libraries loaded with LEAF_TEMPLATE can be instantiated, and
+	// containers can't be loaded that way
+	Leaf *plain = load(path, 0, NULL, 0);
+	Leaf *instance = LeafInit();
+	
+	CHECK(plain && LeafInstantiate(instance, plain) != NULL);
+	
+	LeafFree(instance);
+	LeafFree(plain);
+	
+	size_t elf_length, length;
+	uint8_t *elf = read_file(path, &elf_length);
+	uint8_t *container = elf ? pack_container(elf, &length) : NULL;
+	
+	if (container) {
+		Leaf *leaf = LeafInit();
+		LeafSetFlags(leaf, LEAF_TEMPLATE);
+		CHECK(LeafLoadFromContainer(leaf, container, length) != NULL);
+		LeafFree(leaf);
+	}
+	
+	free(container);
+	free(elf);
+}
+
+int main(int argc, const char *argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s ./test_leaf.so\n", argv[0]);
+		return 1;
+	}
+	
+	test_ifunc(argv[1]);
+	test_overrides(argv[1]);
+	test_rebind(argv[1], 0);
+	test_rebind(argv[1], LEAF_DIRECT_PLT);
+	test_lazy(argv[1]);
+	test_profile(argv[1]);
+	test_unwind(argv[1]);
+	test_inspect(argv[1]);
+	test_async(argv[1], 0);
+	test_async(argv[1], LEAF_DEFER_INIT);
+	test_deferred_init(argv[1]);
+	test_container(argv[1]);
+	test_tls(argv[1], false);
+	test_tls(argv[1], true);
+	test_embedded();
+	test_template(argv[1]);
+	
+	printf("%s\n", gFailures ? "failed" : "passed");
+	
+	return gFailures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,1146 @@
+/**
+ * Checks that the trampolines made by LHRewriteAArch64Block() and
+ * LHRewriteAArch32Block() do the same thing as the instructions they were made
+ * from, and reports how much a hook costs. Random blocks of instructions are
+ * run through a small interpreter before and after they are hooked, so this
+ * works on any 64-bit Linux host (AArch32 code is kept below 4 GiB).
+ *
+ *     gcc -O2 test_trampoline.c -o test_trampoline && ./test_trampoline [seed]
+ *
+ * Exits with 1 if any hooked block ends up in a different state from the
+ * original one.
+ */
+
+#include <stdio.h>
+#define LH_AARCH64
+#define LH_AARCH32
+#define LEAFHOOK_IMPLEMENTATION
+#include "leafhook.h"
+
+#ifndef MAP_32BIT
+#define MAP_32BIT 0
+#endif
+
+// Blocks tried per architecture and random starting states per block
+#define BLOCK_COUNT 4000
+#define INPUT_COUNT 8
+
+// Give up on a run after this many instructions
+#define MAX_STEPS 256
+
+// Calls recorded per run, a call is a bl/blr/blx out of the code being checked
+#define MAX_CALLS 8
+
+// The code being checked goes in the middle of a region this big so pc
+// relative loads have something to read
+#define REGION_SIZE (4 << 20)
+
+// What a simulated callee leaves in the registers it is allowed to clobber
+#define CLOBBER 0x5a5a5a5a5a5a5a5aull
+
+static uint64_t gRandom = 0x9e3779b97f4a7c15ull;
+
+static uint64_t Random(void) {
+	gRandom ^= gRandom << 13;
+	gRandom ^= gRandom >> 7;
+	gRandom ^= gRandom << 17;
+	return gRandom;
+}
+
+static uint64_t RandomBelow(uint64_t n) {
+	return Random() % n;
+}
+
+static uint64_t RandomValue(void) {
+	/**
+	 * Something to put in a register, biased towards values that make
+	 * cbz/tbz and flags interesting
+	 */
+	
+	switch (RandomBelow(4)) {
+		case 0: return 0;
+		case 1: return RandomBelow(16);
+		default: return Random();
+	}
+}
+
+static int64_t SignExtend(uint64_t value, size_t bits) {
+	return (int64_t) (value << (64 - bits)) >> (64 - bits);
+}
+
+static uint8_t *MapRegion(void *hint, int flags) {
+	uint8_t *region = mmap(hint, REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	
+	if (region == MAP_FAILED) {
+		return NULL;
+	}
+	
+	for (size_t i = 0; i < REGION_SIZE; i += 8) {
+		*(uint64_t *) (region + i) = Random();
+	}
+	
+	return region;
+}
+
+static bool ConditionHolds(uint32_t nzcv, uint32_t cond) {
+	bool n = nzcv & 8, z = nzcv & 4, c = nzcv & 2, v = nzcv & 1;
+	bool result;
+	
+	switch (cond >> 1) {
+		case 0: result = z; break;
+		case 1: result = c; break;
+		case 2: result = n; break;
+		case 3: result = v; break;
+		case 4: result = c && !z; break;
+		case 5: result = n == v; break;
+		case 6: result = !z && n == v; break;
+		default: result = true; break;
+	}
+	
+	return (cond & 1) && cond != 0xf ? !result : result;
+}
+
+static uint64_t AddWithCarry(uint64_t a, uint64_t b, bool carry, bool sf, uint32_t *nzcv) {
+	/**
+	 * a + b + carry, setting `nzcv` like an adds/subs of the given size would
+	 */
+	
+	if (!sf) {
+		a &= 0xffffffff;
+		b &= 0xffffffff;
+	}
+	
+	uint64_t result = a + b + carry;
+	uint64_t sign = sf ? 1ull << 63 : 1ull << 31;
+	bool c = sf ? (result < a || (carry && result == a)) : (result >> 32) & 1;
+	bool v = ((a ^ result) & (b ^ result) & sign) != 0;
+	
+	if (!sf) {
+		result &= 0xffffffff;
+	}
+	
+	*nzcv = (!!(result & sign) << 3) | ((result == 0) << 2) | (c << 1) | v;
+	
+	return result;
+}
+
+typedef struct Range {
+	uint64_t start, end;
+} Range;
+
+static bool InRanges(const Range *ranges, size_t count, uint64_t address) {
+	for (size_t i = 0; i < count; i++) {
+		if (address >= ranges[i].start && address < ranges[i].end) {
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+typedef struct Stats {
+	size_t blocks;
+	size_t runs;
+	size_t mismatches;
+	size_t skipped; // Runs where the original code didn't finish
+	size_t hooks;
+	size_t patch_words;
+	size_t tramp_bytes;
+	size_t tramp_bytes_max;
+	int64_t extra_steps;
+	int64_t extra_steps_max;
+} Stats;
+
+static void PrintStats(const char *name, Stats *stats) {
+	if (!stats->hooks) {
+		printf("  %-14s no hooks\n", name);
+		return;
+	}
+	
+	printf("  %-14s %5zu hooks, patch %.1f insns, trampoline %.1f bytes (max %zu), +%.2f insns per call (max %" PRId64 ")\n",
+		name,
+		stats->hooks,
+		(double) stats->patch_words / stats->hooks,
+		(double) stats->tramp_bytes / stats->hooks,
+		stats->tramp_bytes_max,
+		(double) stats->extra_steps / stats->runs,
+		stats->extra_steps_max);
+}
+
+static void DumpWords(const char *title, const uint32_t *words, size_t count) {
+	printf("    %s <%p>:", title, words);
+	
+	for (size_t i = 0; i < count; i++) {
+		printf(" %08x", words[i]);
+	}
+	
+	printf("\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AArch64
+//////////
+
+typedef struct A64State {
+	uint64_t x[31];
+	uint64_t sp;
+	uint64_t pc;
+	uint32_t nzcv;
+	uint8_t v[32][16];
+} A64State;
+
+typedef struct A64Call {
+	uint64_t target;
+	uint64_t args[8];
+} A64Call;
+
+typedef struct A64Run {
+	A64State state; // State at the end of the run, pc is where it left
+	A64Call calls[MAX_CALLS];
+	size_t call_count;
+	size_t steps;
+	const char *error; // Set if the run couldn't be finished
+} A64Run;
+
+static uint64_t A64Read(A64State *s, uint32_t n, bool sp) {
+	return n == 31 ? (sp ? s->sp : 0) : s->x[n];
+}
+
+static void A64Write(A64State *s, uint32_t n, uint64_t value, bool sf, bool sp) {
+	if (!sf) {
+		value &= 0xffffffff;
+	}
+	
+	if (n != 31) {
+		s->x[n] = value;
+	}
+	else if (sp) {
+		s->sp = value;
+	}
+}
+
+static uint64_t A64Shift(uint64_t value, uint32_t type, uint32_t amount, bool sf) {
+	size_t width = sf ? 64 : 32;
+	
+	if (!sf) {
+		value &= 0xffffffff;
+	}
+	
+	if (!amount) {
+		return value;
+	}
+	
+	switch (type) {
+		case 0: value <<= amount; break;
+		case 1: value >>= amount; break;
+		case 2: value = sf ? (uint64_t) ((int64_t) value >> amount) : (uint64_t) ((int32_t) value >> amount); break;
+		default: value = (value >> amount) | (value << (width - amount)); break;
+	}
+	
+	return sf ? value : value & 0xffffffff;
+}
+
+static const char *A64Step(A64State *s, bool *link) {
+	/**
+	 * Run the instruction at s->pc. Only what the rewriter emits or copies in
+	 * the generated blocks is understood.
+	 */
+	
+	uint32_t ins = *(uint32_t *) s->pc;
+	uint64_t pc = s->pc;
+	uint32_t Rd = ins & 31, Rn = (ins >> 5) & 31, Rm = (ins >> 16) & 31;
+	bool sf = ins >> 31;
+	
+	s->pc += 4;
+	*link = false;
+	
+	if ((ins & 0x1f000000) == 0x10000000) {
+		// adr, adrp
+		int64_t imm = SignExtend((((ins >> 5) & 0x7ffff) << 2) | ((ins >> 29) & 3), 21);
+		A64Write(s, Rd, sf ? (pc & ~0xfffull) + (imm << 12) : pc + imm, true, false);
+	}
+	else if ((ins & 0x3b000000) == 0x18000000) {
+		// ldr (literal)
+		uint32_t opc = ins >> 30;
+		uint64_t address = pc + (SignExtend((ins >> 5) & 0x7ffff, 19) << 2);
+		
+		if (ins & (1 << 26)) {
+			if (opc == 3) {
+				return "bad simd load";
+			}
+			
+			memset(s->v[Rd], 0, 16);
+			memcpy(s->v[Rd], (void *) address, 4 << opc);
+		}
+		else if (opc == 0) {
+			A64Write(s, Rd, *(uint32_t *) address, true, false);
+		}
+		else if (opc == 1) {
+			A64Write(s, Rd, *(uint64_t *) address, true, false);
+		}
+		else if (opc == 2) {
+			A64Write(s, Rd, (int64_t) *(int32_t *) address, true, false);
+		}
+	}
+	else if ((ins & 0x7c000000) == 0x14000000) {
+		// b, bl
+		if (sf) {
+			s->x[30] = pc + 4;
+			*link = true;
+		}
+		
+		s->pc = pc + (SignExtend(ins & 0x3ffffff, 26) << 2);
+	}
+	else if ((ins & 0xff000010) == 0x54000000) {
+		// b.cond
+		if (ConditionHolds(s->nzcv, ins & 0xf)) {
+			s->pc = pc + (SignExtend((ins >> 5) & 0x7ffff, 19) << 2);
+		}
+	}
+	else if ((ins & 0x7e000000) == 0x34000000) {
+		// cbz, cbnz
+		uint64_t value = A64Read(s, Rd, false);
+		
+		if (!sf) {
+			value &= 0xffffffff;
+		}
+		
+		if ((value == 0) != ((ins >> 24) & 1)) {
+			s->pc = pc + (SignExtend((ins >> 5) & 0x7ffff, 19) << 2);
+		}
+	}
+	else if ((ins & 0x7e000000) == 0x36000000) {
+		// tbz, tbnz
+		uint32_t bit = (sf << 5) | ((ins >> 19) & 31);
+		
+		if (((A64Read(s, Rd, false) >> bit) & 1) == ((ins >> 24) & 1)) {
+			s->pc = pc + (SignExtend((ins >> 5) & 0x3fff, 14) << 2);
+		}
+	}
+	else if ((ins & 0xff9ffc1f) == 0xd61f0000) {
+		// br, blr, ret
+		uint64_t target = A64Read(s, Rn, false);
+		
+		if (ins & (1 << 21) && !(ins & (1 << 22))) {
+			s->x[30] = pc + 4;
+			*link = true;
+		}
+		
+		s->pc = target;
+	}
+	else if (ins == 0xd503201f) {
+		// nop
+	}
+	else if ((ins & 0x1f000000) == 0x11000000) {
+		// add/sub (immediate)
+		bool sub = (ins >> 30) & 1, flags = (ins >> 29) & 1;
+		uint64_t imm = ((ins >> 10) & 0xfff) << ((ins & (1 << 22)) ? 12 : 0);
+		uint32_t nzcv;
+		uint64_t result = AddWithCarry(A64Read(s, Rn, true), sub ? ~imm : imm, sub, sf, &nzcv);
+		
+		if (flags) {
+			s->nzcv = nzcv;
+		}
+		
+		A64Write(s, Rd, result, sf, !flags);
+	}
+	else if ((ins & 0x1f000000) == 0x0a000000) {
+		// and, orr, eor, ands (shifted register)
+		uint32_t opc = (ins >> 29) & 3;
+		uint64_t a = A64Read(s, Rn, false), b = A64Shift(A64Read(s, Rm, false), (ins >> 22) & 3, (ins >> 10) & 63, sf);
+		uint64_t result;
+		
+		if (ins & (1 << 21)) {
+			b = ~b;
+		}
+		
+		switch (opc) {
+			case 1: result = a | b; break;
+			case 2: result = a ^ b; break;
+			default: result = a & b; break;
+		}
+		
+		if (!sf) {
+			result &= 0xffffffff;
+		}
+		
+		if (opc == 3) {
+			uint64_t sign = sf ? 1ull << 63 : 1ull << 31;
+			s->nzcv = (!!(result & sign) << 3) | ((result == 0) << 2);
+		}
+		
+		A64Write(s, Rd, result, sf, false);
+	}
+	else if ((ins & 0x1f200000) == 0x0b000000) {
+		// add/sub (shifted register)
+		bool sub = (ins >> 30) & 1, flags = (ins >> 29) & 1;
+		uint64_t b = A64Shift(A64Read(s, Rm, false), (ins >> 22) & 3, (ins >> 10) & 63, sf);
+		uint32_t nzcv;
+		uint64_t result = AddWithCarry(A64Read(s, Rn, false), sub ? ~b : b, sub, sf, &nzcv);
+		
+		if (flags) {
+			s->nzcv = nzcv;
+		}
+		
+		A64Write(s, Rd, result, sf, false);
+	}
+	else if ((ins & 0x1f800000) == 0x12800000) {
+		// movn, movz, movk
+		uint32_t opc = (ins >> 29) & 3, shift = ((ins >> 21) & 3) * 16;
+		uint64_t imm = (uint64_t) ((ins >> 5) & 0xffff) << shift;
+		
+		switch (opc) {
+			case 0: A64Write(s, Rd, ~imm, sf, false); break;
+			case 2: A64Write(s, Rd, imm, sf, false); break;
+			case 3: A64Write(s, Rd, (A64Read(s, Rd, false) & ~(0xffffull << shift)) | imm, sf, false); break;
+			default: return "bad move wide";
+		}
+	}
+	else {
+		return "unknown instruction";
+	}
+	
+	return NULL;
+}
+
+static void A64Execute(A64Run *run, const A64State *start, const Range *ranges, size_t range_count, uint64_t hook, uint64_t orig) {
+	/**
+	 * Run from start->pc until control leaves `ranges`. Jumps to `hook` go to
+	 * `orig` as if the hook called the original function straight away, and
+	 * calls out of the ranges return straight away with the scratch registers
+	 * clobbered.
+	 */
+	
+	A64State *s = &run->state;
+	
+	*s = *start;
+	run->call_count = 0;
+	run->steps = 0;
+	run->error = NULL;
+	
+	while (true) {
+		if (hook && s->pc == hook) {
+			s->pc = orig;
+		}
+		
+		if (!InRanges(ranges, range_count, s->pc)) {
+			return;
+		}
+		
+		if (++run->steps > MAX_STEPS) {
+			run->error = "too many steps";
+			return;
+		}
+		
+		bool link;
+		
+		run->error = A64Step(s, &link);
+		
+		if (run->error) {
+			return;
+		}
+		
+		if (link && !InRanges(ranges, range_count, s->pc) && (!hook || s->pc != hook)) {
+			if (run->call_count == MAX_CALLS) {
+				run->error = "too many calls";
+				return;
+			}
+			
+			A64Call *call = &run->calls[run->call_count++];
+			call->target = s->pc;
+			memcpy(call->args, s->x, sizeof call->args);
+			
+			s->pc = s->x[30];
+			s->x[16] = s->x[17] = s->x[30] = CLOBBER;
+		}
+	}
+}
+
+static const char *A64Compare(A64Run *a, A64Run *b) {
+	/**
+	 * Check that two runs ended in the same place with the same state, except
+	 * for x16 and x17 which veneers are allowed to clobber
+	 */
+	
+	static char message[64];
+	
+	if (a->error || b->error) {
+		return a->error ? a->error : b->error;
+	}
+	
+	if (a->state.pc != b->state.pc) {
+		return "exit address";
+	}
+	
+	for (size_t i = 0; i < 31; i++) {
+		if (i != 16 && i != 17 && a->state.x[i] != b->state.x[i]) {
+			snprintf(message, sizeof message, "x%zu: %016" PRIx64 " vs %016" PRIx64, i, a->state.x[i], b->state.x[i]);
+			return message;
+		}
+	}
+	
+	if (a->state.sp != b->state.sp) {
+		return "sp";
+	}
+	
+	if (a->state.nzcv != b->state.nzcv) {
+		return "flags";
+	}
+	
+	if (memcmp(a->state.v, b->state.v, sizeof a->state.v)) {
+		return "simd registers";
+	}
+	
+	if (a->call_count != b->call_count || memcmp(a->calls, b->calls, a->call_count * sizeof *a->calls)) {
+		return "calls";
+	}
+	
+	return NULL;
+}
+
+static uint32_t A64BranchOffset(size_t index, size_t count, size_t bits) {
+	/**
+	 * Pick a branch offset in words for the instruction at `index` that goes
+	 * somewhere outside the block. The rewriters don't handle branches to
+	 * other instructions that get moved, so those aren't tested.
+	 */
+	
+	while (true) {
+		int64_t offset = RandomBelow(2) ? (int64_t) RandomBelow(128) - 64 : SignExtend(Random(), bits);
+		int64_t target = (int64_t) index + offset;
+		
+		if (target < 0 || target >= (int64_t) count) {
+			return offset & ((1ull << bits) - 1);
+		}
+	}
+}
+
+static uint32_t A64RandomReg(void) {
+	/**
+	 * x16 and x17 can be clobbered by the time a function starts, so the
+	 * hook is allowed to use them
+	 */
+	
+	while (true) {
+		uint32_t n = RandomBelow(32);
+		
+		if (n != 16 && n != 17) {
+			return n;
+		}
+	}
+}
+
+static uint32_t A64RandomIns(size_t index, size_t count) {
+	uint32_t Rd = A64RandomReg(), Rn = A64RandomReg(), Rm = A64RandomReg();
+	uint32_t sf = RandomBelow(2);
+	
+	switch (RandomBelow(14)) {
+		case 0: {
+			// adr, adrp
+			uint32_t imm = Random() & 0x1fffff;
+			return (uint32_t) RandomBelow(2) << 31 | (imm & 3) << 29 | 0x10000000 | (imm >> 2) << 5 | Rd;
+		}
+		case 1:
+		case 2: {
+			// ldr (literal), keeping inside the region
+			uint32_t v = RandomBelow(2);
+			uint32_t opc = RandomBelow(v ? 3 : 4);
+			uint32_t imm = (RandomBelow(1 << 18) - (1 << 17)) & 0x7ffff;
+			return opc << 30 | 0x18000000 | v << 26 | imm << 5 | Rd;
+		}
+		case 3: {
+			// b, bl
+			return (uint32_t) RandomBelow(2) << 31 | 0x14000000 | A64BranchOffset(index, count, 26);
+		}
+		case 4: {
+			// b.cond
+			return 0x54000000 | A64BranchOffset(index, count, 19) << 5 | (uint32_t) RandomBelow(16);
+		}
+		case 5: {
+			// cbz, cbnz
+			return sf << 31 | 0x34000000 | (uint32_t) RandomBelow(2) << 24 | A64BranchOffset(index, count, 19) << 5 | Rd;
+		}
+		case 6: {
+			// tbz, tbnz
+			return sf << 31 | 0x36000000 | (uint32_t) RandomBelow(2) << 24 | (uint32_t) RandomBelow(32) << 19 | A64BranchOffset(index, count, 14) << 5 | Rd;
+		}
+		case 7: {
+			// br, blr, ret
+			return 0xd61f0000 | (uint32_t) RandomBelow(3) << 21 | Rn << 5;
+		}
+		case 8: {
+			return 0xd503201f;
+		}
+		case 9:
+		case 10: {
+			// add/sub (immediate)
+			return sf << 31 | (uint32_t) RandomBelow(4) << 29 | 0x11000000 | (uint32_t) RandomBelow(2) << 22 | (uint32_t) RandomBelow(4096) << 10 | Rn << 5 | Rd;
+		}
+		case 11: {
+			// logical (shifted register)
+			return sf << 31 | (uint32_t) RandomBelow(4) << 29 | 0x0a000000 | (uint32_t) RandomBelow(4) << 22 | (uint32_t) RandomBelow(2) << 21 | Rm << 16 | (uint32_t) RandomBelow(sf ? 64 : 32) << 10 | Rn << 5 | Rd;
+		}
+		case 12: {
+			// add/sub (shifted register)
+			return sf << 31 | (uint32_t) RandomBelow(4) << 29 | 0x0b000000 | (uint32_t) RandomBelow(3) << 22 | Rm << 16 | (uint32_t) RandomBelow(sf ? 64 : 32) << 10 | Rn << 5 | Rd;
+		}
+		default: {
+			// movn, movz, movk
+			uint32_t opc = (uint32_t[]) {0, 2, 3}[RandomBelow(3)];
+			return sf << 31 | opc << 29 | 0x12800000 | (uint32_t) RandomBelow(sf ? 4 : 2) << 21 | (uint32_t) RandomBelow(0x10000) << 5 | Rd;
+		}
+	}
+}
+
+static void A64RandomState(A64State *s, uint64_t pc) {
+	for (size_t i = 0; i < 31; i++) {
+		s->x[i] = RandomValue();
+	}
+	
+	for (size_t i = 0; i < 32; i++) {
+		for (size_t j = 0; j < 16; j++) {
+			s->v[i][j] = Random();
+		}
+	}
+	
+	s->sp = Random() & ~15ull;
+	s->nzcv = RandomBelow(16);
+	s->pc = pc;
+}
+
+static bool A64CheckBlock(uint32_t *function, bool near, Stats *stats) {
+	/**
+	 * Fill `function` with random instructions, hook it and check that
+	 * calling through the hook to the original does the same thing as
+	 * calling the original before it was hooked.
+	 */
+	
+	const size_t count = 4;
+	A64State starts[INPUT_COUNT];
+	A64Run before[INPUT_COUNT], after;
+	
+	for (size_t i = 0; i < count; i++) {
+		function[i] = A64RandomIns(i, count);
+	}
+	
+	uint32_t saved[4];
+	memcpy(saved, function, sizeof saved);
+	
+	Range ranges[2] = {{(uint64_t) function, (uint64_t) (function + count)}};
+	
+	for (size_t i = 0; i < INPUT_COUNT; i++) {
+		A64RandomState(&starts[i], (uint64_t) function);
+		A64Execute(&before[i], &starts[i], ranges, 1, 0, 0);
+	}
+	
+	LHHooker *hooker = LHHookerCreate();
+	void *orig;
+	uint64_t hook = (uint64_t) function + (near ? 0x100000 : 0x10000000000ull);
+	
+	if (!hooker || !LHHookerHookFunction(hooker, function, (void *) hook, &orig)) {
+		printf("aarch64: failed to hook block\n");
+		DumpWords("block", saved, count);
+		LHHookerRelease(hooker);
+		return false;
+	}
+	
+	size_t tramp_size = hooker->rwx_block_used - ((uint8_t *) orig - (uint8_t *) hooker->rwx_block);
+	ranges[1] = (Range) {(uint64_t) orig, (uint64_t) orig + tramp_size};
+	
+	stats->blocks++;
+	stats->hooks++;
+	stats->patch_words += near ? 1 : 4;
+	stats->tramp_bytes += tramp_size;
+	stats->tramp_bytes_max = tramp_size > stats->tramp_bytes_max ? tramp_size : stats->tramp_bytes_max;
+	
+	bool ok = true;
+	
+	for (size_t i = 0; i < INPUT_COUNT; i++) {
+		if (before[i].error) {
+			stats->skipped++;
+			continue;
+		}
+		
+		A64Execute(&after, &starts[i], ranges, 2, hook, (uint64_t) orig);
+		
+		const char *error = A64Compare(&before[i], &after);
+		
+		stats->runs++;
+		
+		if (error) {
+			if (stats->mismatches++ < 5) {
+				printf("aarch64 %s: mismatch (%s)\n", near ? "near" : "far", error);
+				DumpWords("block", saved, count);
+				DumpWords("trampoline", orig, tramp_size / 4);
+			}
+			
+			ok = false;
+			break;
+		}
+		
+		int64_t extra = (int64_t) after.steps - (int64_t) before[i].steps;
+		stats->extra_steps += extra;
+		stats->extra_steps_max = extra > stats->extra_steps_max ? extra : stats->extra_steps_max;
+	}
+	
+	LHHookerRelease(hooker);
+	
+	return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AArch32
+//////////
+
+typedef struct A32State {
+	uint32_t r[16]; // r[15] is the address of the next instruction
+	uint32_t nzcv;
+} A32State;
+
+typedef struct A32Call {
+	uint32_t target;
+	uint32_t args[4];
+} A32Call;
+
+typedef struct A32Run {
+	A32State state;
+	A32Call calls[MAX_CALLS];
+	size_t call_count;
+	size_t steps;
+	const char *error;
+} A32Run;
+
+static uint32_t A32Shift(uint32_t value, uint32_t type, uint32_t amount, bool *carry) {
+	/**
+	 * Apply an immediate shift from a data processing instruction, updating
+	 * the shifter carry out
+	 */
+	
+	switch (type) {
+		case 0:
+			if (amount) {
+				*carry = (value >> (32 - amount)) & 1;
+				value <<= amount;
+			}
+			
+			return value;
+		case 1:
+			amount = amount ? amount : 32;
+			*carry = (value >> (amount - 1)) & 1;
+			return amount == 32 ? 0 : value >> amount;
+		case 2:
+			amount = amount ? amount : 32;
+			*carry = (value >> (amount - 1)) & 1;
+			return amount == 32 ? (uint32_t) ((int32_t) value >> 31) : (uint32_t) ((int32_t) value >> amount);
+		default:
+			if (!amount) {
+				// rrx
+				bool old = *carry;
+				*carry = value & 1;
+				return (value >> 1) | ((uint32_t) old << 31);
+			}
+			
+			value = (value >> amount) | (value << (32 - amount));
+			*carry = value >> 31;
+			return value;
+	}
+}
+
+static const char *A32Step(A32State *s, bool *link) {
+	uint32_t ins = *(uint32_t *) (uintptr_t) s->r[15];
+	uint32_t pc = s->r[15] + 8;
+	uint32_t cond = ins >> 28;
+	uint32_t Rn = (ins >> 16) & 15, Rd = (ins >> 12) & 15, Rm = ins & 15;
+	
+	s->r[15] += 4;
+	*link = false;
+	
+	if (cond == 0xf) {
+		if ((ins & 0x0e000000) != 0x0a000000) {
+			return "unknown instruction";
+		}
+		
+		// blx (immediate), which goes to thumb code, so the target is odd
+		s->r[14] = pc - 4;
+		s->r[15] = (pc + (SignExtend(ins & 0xffffff, 24) << 2) + ((ins >> 23) & 2)) | 1;
+		*link = true;
+		return NULL;
+	}
+	
+	if (!ConditionHolds(s->nzcv, cond)) {
+		return NULL;
+	}
+	
+	#define A32_READ(n) ((n) == 15 ? pc : s->r[n])
+	
+	if ((ins & 0x0ffffff0) == 0x012fff10) {
+		// bx
+		s->r[15] = s->r[Rm];
+	}
+	else if ((ins & 0x0ffffff0) == 0x012fff30) {
+		// blx (register)
+		s->r[15] = s->r[Rm];
+		s->r[14] = pc - 4;
+		*link = true;
+	}
+	else if ((ins & 0x0e000000) == 0x0a000000) {
+		// b, bl
+		if (ins & (1 << 24)) {
+			s->r[14] = pc - 4;
+			*link = true;
+		}
+		
+		s->r[15] = pc + (SignExtend(ins & 0xffffff, 24) << 2);
+	}
+	else if ((ins & 0x0f7f0000) == 0x051f0000) {
+		// ldr (literal)
+		uint32_t address = (pc & ~3) + ((ins & (1 << 23)) ? (ins & 0xfff) : -(ins & 0xfff));
+		s->r[Rd] = *(uint32_t *) (uintptr_t) address;
+	}
+	else if ((ins & 0x0c000000) == 0 && ((ins & 0x02000000) || !(ins & 0x10)) && (ins & 0x01900000) != 0x01000000) {
+		// Data processing with an immediate or a register shifted by an
+		// immediate
+		uint32_t opcode = (ins >> 21) & 15;
+		bool flags = (ins >> 20) & 1;
+		bool carry = (s->nzcv >> 1) & 1;
+		uint32_t a = A32_READ(Rn), b;
+		
+		if (ins & 0x02000000) {
+			b = LHAArch32ExpandImm(ins & 0xfff);
+			
+			if (ins & 0xf00) {
+				carry = b >> 31;
+			}
+		}
+		else {
+			b = A32Shift(A32_READ(Rm), (ins >> 5) & 3, (ins >> 7) & 31, &carry);
+		}
+		
+		uint32_t nzcv = s->nzcv;
+		bool c = (nzcv >> 1) & 1;
+		uint64_t result;
+		bool arithmetic = true;
+		
+		switch (opcode) {
+			case 0: case 8: result = a & b; arithmetic = false; break;
+			case 1: case 9: result = a ^ b; arithmetic = false; break;
+			case 2: case 10: result = AddWithCarry(a, ~b, 1, false, &nzcv); break;
+			case 3: result = AddWithCarry(b, ~a, 1, false, &nzcv); break;
+			case 4: case 11: result = AddWithCarry(a, b, 0, false, &nzcv); break;
+			case 5: result = AddWithCarry(a, b, c, false, &nzcv); break;
+			case 6: result = AddWithCarry(a, ~b, c, false, &nzcv); break;
+			case 7: result = AddWithCarry(b, ~a, c, false, &nzcv); break;
+			case 12: result = a | b; arithmetic = false; break;
+			case 13: result = b; arithmetic = false; break;
+			case 14: result = a & ~b; arithmetic = false; break;
+			default: result = ~b; arithmetic = false; break;
+		}
+		
+		result &= 0xffffffff;
+		
+		if (!arithmetic) {
+			nzcv = (!!(result & 0x80000000) << 3) | ((result == 0) << 2) | (carry << 1) | (s->nzcv & 1);
+		}
+		
+		if (flags) {
+			s->nzcv = nzcv;
+		}
+		
+		// tst, teq, cmp and cmn only set flags
+		if (opcode < 8 || opcode > 11) {
+			s->r[Rd] = result;
+		}
+	}
+	else {
+		return "unknown instruction";
+	}
+	
+	#undef A32_READ
+	
+	return NULL;
+}
+
+static void A32Execute(A32Run *run, const A32State *start, const Range *ranges, size_t range_count, uint32_t hook, uint32_t orig) {
+	/**
+	 * Like A64Execute(), r12 and lr are clobbered by calls
+	 */
+	
+	A32State *s = &run->state;
+	
+	*s = *start;
+	run->call_count = 0;
+	run->steps = 0;
+	run->error = NULL;
+	
+	while (true) {
+		if (hook && s->r[15] == hook) {
+			s->r[15] = orig;
+		}
+		
+		if (!InRanges(ranges, range_count, s->r[15])) {
+			return;
+		}
+		
+		if (++run->steps > MAX_STEPS) {
+			run->error = "too many steps";
+			return;
+		}
+		
+		bool link;
+		
+		run->error = A32Step(s, &link);
+		
+		if (run->error) {
+			return;
+		}
+		
+		if (link && !InRanges(ranges, range_count, s->r[15]) && (!hook || s->r[15] != hook)) {
+			if (run->call_count == MAX_CALLS) {
+				run->error = "too many calls";
+				return;
+			}
+			
+			A32Call *call = &run->calls[run->call_count++];
+			call->target = s->r[15];
+			memcpy(call->args, s->r, sizeof call->args);
+			
+			s->r[15] = s->r[14];
+			s->r[12] = s->r[14] = (uint32_t) CLOBBER;
+		}
+	}
+}
+
+static const char *A32Compare(A32Run *a, A32Run *b) {
+	/**
+	 * Like A64Compare(), r12 is the scratch register for long jumps
+	 */
+	
+	static char message[64];
+	
+	if (a->error || b->error) {
+		return a->error ? a->error : b->error;
+	}
+	
+	for (size_t i = 0; i < 16; i++) {
+		if (i != 12 && a->state.r[i] != b->state.r[i]) {
+			snprintf(message, sizeof message, "r%zu: %08x vs %08x", i, a->state.r[i], b->state.r[i]);
+			return message;
+		}
+	}
+	
+	if (a->state.nzcv != b->state.nzcv) {
+		return "flags";
+	}
+	
+	if (a->call_count != b->call_count || memcmp(a->calls, b->calls, a->call_count * sizeof *a->calls)) {
+		return "calls";
+	}
+	
+	return NULL;
+}
+
+static uint32_t A32RandomReg(void) {
+	/**
+	 * Any register but r12, which the hook uses, and pc
+	 */
+	
+	uint32_t n = RandomBelow(14);
+	
+	return n >= 12 ? n + 1 : n;
+}
+
+static uint32_t A32RandomIns(size_t index, size_t count) {
+	/**
+	 * Random instructions that the AArch32 rewriter claims to handle. It
+	 * doesn't move pc relative instructions other than adr, ldr (literal), b,
+	 * bl and blx, and only recognises adr and ldr when they are unconditional.
+	 */
+	
+	uint32_t cond = RandomBelow(15);
+	uint32_t Rd = A32RandomReg(), Rn = A32RandomReg(), Rm = A32RandomReg();
+	
+	switch (RandomBelow(8)) {
+		case 0: {
+			// adr, both add and sub forms
+			return (RandomBelow(2) ? 0xe28f0000 : 0xe24f0000) | Rd << 12 | (uint32_t) RandomBelow(4096);
+		}
+		case 1: {
+			// ldr (literal)
+			return 0xe51f0000 | (uint32_t) RandomBelow(2) << 23 | Rd << 12 | (uint32_t) RandomBelow(4096);
+		}
+		case 2:
+		case 3: {
+			// b, bl and blx (immediate), which is cond 0b1111
+			uint32_t kind = RandomBelow(3);
+			
+			if (kind == 2) {
+				cond = 0xf;
+				kind = RandomBelow(2);
+			}
+			
+			while (true) {
+				int32_t offset = RandomBelow(2) ? (int32_t) RandomBelow(128) - 64 : (int32_t) SignExtend(Random(), 24);
+				int64_t target = (int64_t) index + 2 + offset;
+				
+				if (target < 0 || target >= (int64_t) count) {
+					return cond << 28 | 0x0a000000 | kind << 24 | (offset & 0xffffff);
+				}
+			}
+		}
+		case 4: {
+			// bx, blx (register)
+			return cond << 28 | 0x012fff10 | (uint32_t) RandomBelow(2) << 5 | Rm;
+		}
+		case 5:
+		case 6: {
+			// data processing (immediate)
+			uint32_t opcode = RandomBelow(16);
+			uint32_t S = opcode >= 8 && opcode <= 11 ? 1 : RandomBelow(2);
+			return cond << 28 | 0x02000000 | opcode << 21 | S << 20 | Rn << 16 | Rd << 12 | (uint32_t) RandomBelow(4096);
+		}
+		default: {
+			// data processing (register, immediate shift)
+			uint32_t opcode = RandomBelow(16);
+			uint32_t S = opcode >= 8 && opcode <= 11 ? 1 : RandomBelow(2);
+			return cond << 28 | opcode << 21 | S << 20 | Rn << 16 | Rd << 12 | (uint32_t) RandomBelow(32) << 7 | (uint32_t) RandomBelow(4) << 5 | Rm;
+		}
+	}
+}
+
+static bool A32CheckBlock(uint32_t *function, Stats *stats) {
+	const size_t count = 3;
+	A32State starts[INPUT_COUNT];
+	A32Run before[INPUT_COUNT], after;
+	
+	for (size_t i = 0; i < count; i++) {
+		function[i] = A32RandomIns(i, count);
+	}
+	
+	uint32_t saved[3];
+	memcpy(saved, function, sizeof saved);
+	
+	uint32_t start = (uint32_t) (uintptr_t) function;
+	Range ranges[2] = {{start, start + count * 4}};
+	
+	for (size_t i = 0; i < INPUT_COUNT; i++) {
+		for (size_t j = 0; j < 15; j++) {
+			starts[i].r[j] = RandomValue();
+		}
+		
+		starts[i].r[15] = start;
+		starts[i].nzcv = RandomBelow(16);
+		
+		A32Execute(&before[i], &starts[i], ranges, 1, 0, 0);
+	}
+	
+	// The rewriter works with 32 bit addresses, so the trampolines have to go
+	// below 4 GiB too
+	LHHooker *hooker = LHHookerCreate();
+	
+	if (!hooker) {
+		return false;
+	}
+	
+	munmap(hooker->rwx_block, hooker->rwx_block_size);
+	hooker->rwx_block = mmap(NULL, hooker->rwx_block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	
+	if (hooker->rwx_block == MAP_FAILED) {
+		hooker->rwx_block = NULL;
+		LHHookerRelease(hooker);
+		return false;
+	}
+	
+	uint32_t *orig;
+	uint32_t hook = start + 0x100000;
+	
+	if (!LHHookerAArch32Function(hooker, function, (uint32_t *) (uintptr_t) hook, &orig)) {
+		printf("aarch32: failed to hook block\n");
+		LHHookerRelease(hooker);
+		return false;
+	}
+	
+	size_t tramp_size = hooker->rwx_block_used;
+	ranges[1] = (Range) {(uint32_t) (uintptr_t) orig, (uint32_t) (uintptr_t) orig + tramp_size};
+	
+	stats->blocks++;
+	stats->hooks++;
+	stats->patch_words += 3;
+	stats->tramp_bytes += tramp_size;
+	stats->tramp_bytes_max = tramp_size > stats->tramp_bytes_max ? tramp_size : stats->tramp_bytes_max;
+	
+	bool ok = true;
+	
+	for (size_t i = 0; i < INPUT_COUNT; i++) {
+		if (before[i].error) {
+			stats->skipped++;
+			continue;
+		}
+		
+		A32Execute(&after, &starts[i], ranges, 2, hook, (uint32_t) (uintptr_t) orig);
+		
+		const char *error = A32Compare(&before[i], &after);
+		
+		stats->runs++;
+		
+		if (error) {
+			if (stats->mismatches++ < 5) {
+				printf("aarch32: mismatch (%s)\n", error);
+				DumpWords("block", saved, count);
+				DumpWords("trampoline", orig, tramp_size / 4);
+			}
+			
+			ok = false;
+			break;
+		}
+		
+		int64_t extra = (int64_t) after.steps - (int64_t) before[i].steps;
+		stats->extra_steps += extra;
+		stats->extra_steps_max = extra > stats->extra_steps_max ? extra : stats->extra_steps_max;
+	}
+	
+	LHHookerRelease(hooker);
+	
+	return ok;
+}
+
+int main(int argc, const char *argv[]) {
+	if (argc > 1) {
+		gRandom = strtoull(argv[1], NULL, 0) | 1;
+	}
+	
+	printf("seed 0x%" PRIx64 "\n", gRandom);
+	
+	// One region next to where the hooker's memory is likely to end up, so
+	// most things are in range of the original instructions, and one far
+	// away so that the rewriter has to use literal pools and veneers
+	uint8_t *near_region = MapRegion(NULL, 0);
+	uint8_t *far_region = MapRegion((void *) 0x300000000000ull, 0);
+	uint8_t *low_region = MapRegion(NULL, MAP_32BIT);
+	
+	if (!near_region || !far_region || !low_region || (uintptr_t) low_region + REGION_SIZE > 0xffffffffull) {
+		printf("Could not map test regions\n");
+		return 2;
+	}
+	
+	Stats near = {0}, far = {0}, a32 = {0};
+	
+	for (size_t i = 0; i < BLOCK_COUNT; i++) {
+		uint8_t *region = (i & 2) ? far_region : near_region;
+		A64CheckBlock((uint32_t *) (region + REGION_SIZE / 2), i & 1, (i & 1) ? &near : &far);
+	}
+	
+	for (size_t i = 0; i < BLOCK_COUNT; i++) {
+		A32CheckBlock((uint32_t *) (low_region + REGION_SIZE / 2), &a32);
+	}
+	
+	size_t a64_mismatches = near.mismatches + far.mismatches;
+	size_t a64_runs = near.runs + far.runs;
+	
+	printf("aarch64: %zu blocks, %zu runs, %zu mismatches, %zu skipped\n", near.blocks + far.blocks, a64_runs, a64_mismatches, near.skipped + far.skipped);
+	PrintStats("near hook", &near);
+	PrintStats("far hook", &far);
+	printf("aarch32: %zu blocks, %zu runs, %zu mismatches, %zu skipped\n", a32.blocks, a32.runs, a32.mismatches, a32.skipped);
+	PrintStats("hook", &a32);
+	
+	return a64_mismatches || a32.mismatches ? 1 : 0;
+}
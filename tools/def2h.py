@@ -1,6 +1,8 @@
 #!/usr/bin/env python3
 """
 Compile LeafHook def's to headers
+
+Usage: def2h.py <file.def> [header to splice into]
 """
 
 from enum import Enum
@@ -80,10 +82,11 @@ class Bits:
 		if self.type == BitClass.LITERAL:
 			return f"(0b{self.data} << {shift})"
 		else:
-			return f"((({self.name}{f' >> {self.offset}' if self.offset != 0 else ''}) & {hex((1 << self.size) - 1)}) << {shift})"
+			value = f"(({self.name}) >> {self.offset})" if self.offset != 0 else f"({self.name})"
+			return f"(({value} & {hex((1 << self.size) - 1)}) << {shift})"
 	
 	def getDecodeExpr(self, input_name, shift):
-		return f"((({input_name} >> {shift}) & {hex((1 << self.getSize()) - 1)}) << {self.offset})"
+		return f"(((({input_name}) >> {shift}) & {hex((1 << self.getSize()) - 1)}) << {self.offset})"
 	
 	def getMask(self, shift):
 		return hex(((1 << self.getSize()) - 1) << shift)
@@ -91,10 +94,29 @@ class Bits:
 	def __repr__(self):
 		return f"0b{self.data}" if self.type == BitClass.LITERAL else f"[{self.name}:{self.size}:{self.offset}]"
 
+# How architecture prefixes are spelled in C names
+ARCH_NAMES = {
+	"aarch64": "AArch64",
+	"aarch32": "AArch32",
+}
+
+def camel(name):
+	return "".join(x[0].upper() + x[1:] for x in name.split("_"))
+
 class Instr:
 	def __init__(self, name):
 		self.name = name
 		self.bits = []
+		self.arch, self.short_name = name.split("_", 1)
+	
+	def getArchName(self):
+		return ARCH_NAMES.get(self.arch, camel(self.arch))
+	
+	def getFuncName(self, kind, field = ""):
+		return f"LH{kind}{self.getArchName()}{camel(self.short_name)}{camel(field) if field else ''}"
+	
+	def getClassName(self):
+		return f"LH_{self.arch.upper()}_INS_{self.short_name.upper()}"
 	
 	def append(self, b):
 		self.bits.append(b)
@@ -109,20 +131,6 @@ class Instr:
 		
 		return v
 	
-	def getMakeDefine(self):
-		s = f"#define MAKE_{self.name.upper()}({', '.join(self.getVars())}) "
-		
-		l = []
-		p = 0
-		
-		for b in reversed(self.bits):
-			l.append(b.getSymbolic(p))
-			p += b.getSize()
-		
-		s += "(" + " | ".join(l) + ")"
-		
-		return s
-	
 	def getOffsetFor(self, bit):
 		l = 0
 		
@@ -134,30 +142,7 @@ class Instr:
 		
 		return 32 - l
 	
-	def getDecodeDefines(self):
-		bits_by_var = {}
-		
-		for b in self.bits:
-			if b.getType() == BitClass.PARAM:
-				if b.name in bits_by_var:
-					bits_by_var[b.name].append(b)
-				else:
-					bits_by_var[b.name] = [b]
-		
-		s = ""
-		
-		for name, bits in bits_by_var.items():
-			s += f"#define {self.name.upper()}_DECODE_{name.upper()}(input) "
-			l = []
-			
-			for b in bits:
-				l.append(b.getDecodeExpr('input', self.getOffsetFor(b)))
-			
-			s += "(" + " | ".join(l) + ")\n"
-		
-		return s.rstrip()
-	
-	def getIsDefine(self):
+	def getMaskAndValue(self):
 		p = 0
 		mask = 0
 		val = 0
@@ -169,7 +154,40 @@ class Instr:
 			
 			p += b.getSize()
 		
-		return f"#define IS_{self.name.upper()}(input) ((input & {hex(mask)}) == {hex(val)})"
+		if p != 32:
+			raise Exception(f"{self.name} is {p} bits long instead of 32")
+		
+		return mask, val
+	
+	def getMakeFunction(self):
+		args = ", ".join(f"uint32_t {v}" for v in self.getVars())
+		l = []
+		p = 0
+		
+		for b in reversed(self.bits):
+			l.append(b.getSymbolic(p))
+			p += b.getSize()
+		
+		return f"static inline uint32_t {self.getFuncName('Make')}({args or 'void'}) {{\n\treturn {' | '.join(l)};\n}}"
+	
+	def getDecodeFunctions(self):
+		bits_by_var = {}
+		
+		for b in self.bits:
+			if b.getType() == BitClass.PARAM:
+				bits_by_var.setdefault(b.name, []).append(b)
+		
+		s = []
+		
+		for name, bits in bits_by_var.items():
+			expr = " | ".join(b.getDecodeExpr('ins', self.getOffsetFor(b)) for b in bits)
+			s.append(f"static inline uint32_t {self.getFuncName('Decode', name)}(uint32_t ins) {{\n\treturn {expr};\n}}")
+		
+		return "\n\n".join(s)
+	
+	def getIsFunction(self):
+		mask, val = self.getMaskAndValue()
+		return f"static inline bool {self.getFuncName('Is')}(uint32_t ins) {{\n\treturn (ins & {hex(mask)}) == {hex(val)};\n}}"
 	
 	def __repr__(self):
 		return f"[Instr: {' '.join([repr(x) for x in self.bits])}]"
@@ -272,15 +290,134 @@ def parse(tokens):
 	
 	return items
 
+def buildTree(cands, used = 0):
+	"""
+	Build a decision tree that tells the candidates apart. Returns either a
+	list of candidates left to check with a full mask compare or a tuple
+	(bit, zero subtree, one subtree).
+	"""
+	
+	if len(cands) <= 1:
+		return cands
+	
+	best = None
+	
+	for bit in range(31, -1, -1):
+		if used & (1 << bit):
+			continue
+		
+		# Candidates that don't care about this bit go down both sides
+		zeros = [c for c in cands if not (c.mask >> bit) & 1 or not (c.val >> bit) & 1]
+		ones = [c for c in cands if not (c.mask >> bit) & 1 or (c.val >> bit) & 1]
+		
+		if len(zeros) == len(cands) and len(ones) == len(cands):
+			continue
+		
+		score = (max(len(zeros), len(ones)), len(zeros) + len(ones))
+		
+		if best is None or score < best[0]:
+			best = (score, bit, zeros, ones)
+	
+	if best is None:
+		# Overlapping encodings, most specific one wins
+		return sorted(cands, key = lambda c: -bin(c.mask).count("1"))
+	
+	_, bit, zeros, ones = best
+	
+	return (bit, buildTree(zeros, used | (1 << bit)), buildTree(ones, used | (1 << bit)))
+
+def emitTree(tree, unknown, depth = 1):
+	tabs = "\t" * depth
+	
+	if type(tree) == list:
+		s = ""
+		
+		for c in tree[:-1]:
+			s += f"{tabs}if ((ins & {hex(c.mask)}) == {hex(c.val)}) {{\n{tabs}\treturn {c.getClassName()};\n{tabs}}}\n"
+		
+		if tree:
+			c = tree[-1]
+			return s + f"{tabs}return (ins & {hex(c.mask)}) == {hex(c.val)} ? {c.getClassName()} : {unknown};\n"
+		
+		return s + f"{tabs}return {unknown};\n"
+	
+	bit, zeros, ones = tree
+	
+	s = f"{tabs}if (ins & {hex(1 << bit)}) {{\n"
+	s += emitTree(ones, unknown, depth + 1)
+	s += f"{tabs}}}\n"
+	s += f"{tabs}else {{\n"
+	s += emitTree(zeros, unknown, depth + 1)
+	s += f"{tabs}}}\n"
+	
+	return s
+
+def emitClassifier(arch, instrs):
+	"""
+	Emit the instruction class enum and a function that maps an instruction
+	word to its class with a decision tree over the opcode bits.
+	"""
+	
+	arch_name = instrs[0].getArchName()
+	unknown = f"LH_{arch.upper()}_INS_UNKNOWN"
+	
+	for x in instrs:
+		x.mask, x.val = x.getMaskAndValue()
+	
+	s = f"typedef enum LH{arch_name}InsClass {{\n"
+	s += f"\t{unknown} = 0,\n"
+	
+	for x in instrs:
+		s += f"\t{x.getClassName()},\n"
+	
+	s += f"}} LH{arch_name}InsClass;\n\n"
+	s += f"static inline LH{arch_name}InsClass LHClassify{arch_name}(uint32_t ins) {{\n"
+	s += emitTree(buildTree(instrs), unknown)
+	s += "}"
+	
+	return s
+
+def generate(instrs):
+	out = []
+	archs = {}
+	
+	for x in instrs:
+		archs.setdefault(x.arch, []).append(x)
+	
+	for arch, arch_instrs in archs.items():
+		out.append(f"// {arch_instrs[0].getArchName()}")
+		
+		for x in arch_instrs:
+			out.append(x.getMakeFunction())
+			
+			decode = x.getDecodeFunctions()
+			
+			if decode:
+				out.append(decode)
+			
+			out.append(x.getIsFunction())
+		
+		out.append(emitClassifier(arch, arch_instrs))
+	
+	return "\n\n".join(out) + "\n"
+
+BEGIN_MARKER = "// Automatically generated functions for working with ARM instructions\n"
+END_MARKER = "// END AUTO GENERATED FUNCTIONS"
+
 def main():
 	ins = parse(tokenise(Path(sys.argv[1]).read_text()))
+	code = generate(ins)
 	
-	print("//", ins)
+	if len(sys.argv) < 3:
+		print(code, end = "")
+		return
 	
-	for x in ins:
-		print(x.getMakeDefine())
-		print(x.getDecodeDefines())
-		print(x.getIsDefine())
+	# Replace what is between the markers in the header
+	header = Path(sys.argv[2])
+	text = header.read_text()
+	start = text.index(BEGIN_MARKER) + len(BEGIN_MARKER)
+	end = text.index(END_MARKER)
+	header.write_text(text[:start] + code + text[end:])
 
 if __name__ == "__main__":
 	main()
@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+"""
+Make a header that embeds a file into its own page aligned read only section
+with .incbin, for use with LeafLoadFromEmbedded()
+
+Usage: f2incbin.py <file> [alignment, default 4096]
+"""
+
+import sys
+from pathlib import Path
+
+in_path = Path(sys.argv[1]).resolve()
+align = int(sys.argv[2]) if len(sys.argv) > 2 else 4096
+out_name = f"{sys.argv[1]}.incbin.h"
+name = f"g{in_path.name.split('.')[0].title()}Data"
+
+with open(out_name, "w") as f:
+	f.write(f"// Embeds {in_path.name}, generated by tools/f2incbin.py\n")
+	f.write(f"#include <stdint.h>\n")
+	f.write(f"#include <stddef.h>\n\n")
+	f.write(f"__asm__(\n")
+	f.write(f"\t\".pushsection .leaf.{name}, \\\"a\\\"\\n\"\n")
+	f.write(f"\t\".balign {align}\\n\"\n")
+	f.write(f"\t\".global {name}\\n\"\n")
+	f.write(f"\t\"{name}:\\n\"\n")
+	f.write(f"\t\".incbin \\\"{in_path}\\\"\\n\"\n")
+	f.write(f"\t\".global {name}End\\n\"\n")
+	f.write(f"\t\"{name}End:\\n\"\n")
+	f.write(f"\t\".popsection\\n\"\n")
+	f.write(f");\n\n")
+	f.write(f"extern const uint8_t {name}[];\n")
+	f.write(f"extern const uint8_t {name}End[];\n")
+	f.write(f"#define {name}Size ((size_t) ({name}End - {name}))\n")
@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+"""
+Pack a shared object into a compressed Leaf container for
+LeafLoadFromContainer()
+
+Usage: leafpack.py <file.so> [chunk size in KiB, default 256]
+
+Layout (little endian):
+
+	header:  "LEAFPAK\\0", u32 chunk_count, u32 elf_size, u32 dynamic_size,
+	         u32 strtab_size
+	chunks:  chunk_count * (u64 vaddr, u32 size, u32 packed_size, u64 offset)
+	elf:     the start of the file up to the end of the program headers
+	dynamic: copy of the PT_DYNAMIC contents
+	strtab:  copy of the DT_STRTAB contents
+	data:    chunk contents, LZ4 blocks or stored if packed_size == size
+
+Each PT_LOAD is split into chunks that are compressed on their own so they
+can be decompressed in parallel.
+"""
+
+import struct
+import sys
+from pathlib import Path
+
+MAGIC = b"LEAFPAK\0"
+PT_LOAD = 1
+PT_DYNAMIC = 2
+DT_NULL = 0
+DT_STRTAB = 5
+DT_STRSZ = 10
+
+def lz4WriteLength(out, length):
+	while length >= 255:
+		out.append(255)
+		length -= 255
+	
+	out.append(length)
+
+def lz4Sequence(out, literals, offset = 0, match = 0):
+	lit_len = len(literals)
+	match_len = match - 4 if offset else 0
+	
+	out.append((min(lit_len, 15) << 4) | min(match_len, 15))
+	
+	if lit_len >= 15:
+		lz4WriteLength(out, lit_len - 15)
+	
+	out += literals
+	
+	if offset:
+		out += struct.pack("<H", offset)
+		
+		if match_len >= 15:
+			lz4WriteLength(out, match_len - 15)
+
+def lz4Compress(data):
+	"""
+	Compress to a raw LZ4 block. Greedy and simple, but the output is valid
+	LZ4 so any LZ4 decoder can read it.
+	"""
+	
+	try:
+		import lz4.block
+		return lz4.block.compress(data, store_size = False, mode = "high_compression")
+	except ImportError:
+		pass
+	
+	out = bytearray()
+	table = {}
+	n = len(data)
+	anchor = 0
+	i = 0
+	
+	# The last match has to start 12 bytes before the end and the last 5
+	# bytes are always literals
+	while i < n - 12:
+		seq = data[i:i + 4]
+		j = table.get(seq)
+		table[seq] = i
+		
+		if j is None or i - j > 0xffff:
+			i += 1
+			continue
+		
+		match = 4
+		limit = n - 5 - i
+		
+		while match < limit and data[j + match] == data[i + match]:
+			match += 1
+		
+		lz4Sequence(out, data[anchor:i], i - j, match)
+		
+		i += match
+		anchor = i
+	
+	lz4Sequence(out, data[anchor:])
+	
+	return bytes(out)
+
+def main():
+	path = Path(sys.argv[1])
+	chunk_size = (int(sys.argv[2]) if len(sys.argv) > 2 else 256) * 1024
+	data = path.read_bytes()
+	
+	if data[:4] != b"\x7fELF" or data[5] != 1:
+		raise Exception("Not a little endian ELF file")
+	
+	is64 = data[4] == 2
+	
+	if is64:
+		phoff, = struct.unpack_from("<Q", data, 0x20)
+		phentsize, phnum = struct.unpack_from("<HH", data, 0x36)
+	else:
+		phoff, = struct.unpack_from("<I", data, 0x1c)
+		phentsize, phnum = struct.unpack_from("<HH", data, 0x2a)
+	
+	phdrs = []
+	
+	for i in range(phnum):
+		if is64:
+			p_type, _, p_offset, p_vaddr, _, p_filesz, _ = struct.unpack_from("<IIQQQQQ", data, phoff + i * phentsize)
+		else:
+			p_type, p_offset, p_vaddr, _, p_filesz, _, _ = struct.unpack_from("<IIIIIII", data, phoff + i * phentsize)
+		
+		phdrs.append((p_type, p_offset, p_vaddr, p_filesz))
+	
+	elf = data[:phoff + phnum * phentsize]
+	
+	# Keep the dynamic section and the string table uncompressed so the
+	# loader can open dependencies while the chunks are decompressed
+	dynamic = b""
+	strtab = b""
+	
+	for p_type, p_offset, p_vaddr, p_filesz in phdrs:
+		if p_type == PT_DYNAMIC:
+			dynamic = data[p_offset:p_offset + p_filesz]
+	
+	def vaddrToOffset(vaddr):
+		for p_type, p_offset, p_vaddr, p_filesz in phdrs:
+			if p_type == PT_LOAD and p_vaddr <= vaddr < p_vaddr + p_filesz:
+				return vaddr - p_vaddr + p_offset
+		
+		raise Exception(f"Address 0x{vaddr:x} is not in the file")
+	
+	dyn_format = "<qQ" if is64 else "<iI"
+	strtab_addr = None
+	strtab_size = 0
+	
+	for tag, value in struct.iter_unpack(dyn_format, dynamic):
+		if tag == DT_NULL:
+			break
+		elif tag == DT_STRTAB:
+			strtab_addr = value
+		elif tag == DT_STRSZ:
+			strtab_size = value
+	
+	if strtab_addr is not None:
+		start = vaddrToOffset(strtab_addr)
+		strtab = data[start:start + strtab_size]
+	
+	chunks = []
+	packed = []
+	
+	for p_type, p_offset, p_vaddr, p_filesz in phdrs:
+		if p_type != PT_LOAD:
+			continue
+		
+		for start in range(0, p_filesz, chunk_size):
+			raw = data[p_offset + start:p_offset + min(start + chunk_size, p_filesz)]
+			compressed = lz4Compress(raw)
+			
+			if len(compressed) >= len(raw):
+				compressed = raw
+			
+			chunks.append((p_vaddr + start, len(raw), len(compressed)))
+			packed.append(compressed)
+	
+	header_size = 24 + 24 * len(chunks) + len(elf) + len(dynamic) + len(strtab)
+	out = bytearray(MAGIC + struct.pack("<IIII", len(chunks), len(elf), len(dynamic), len(strtab)))
+	offset = header_size
+	
+	for vaddr, size, packed_size in chunks:
+		out += struct.pack("<QIIQ", vaddr, size, packed_size, offset)
+		offset += packed_size
+	
+	out += elf + dynamic + strtab
+	
+	for p in packed:
+		out += p
+	
+	Path(f"{path}.leafpak").write_bytes(out)
+	
+	print(f"{len(data)} -> {len(out)} bytes in {len(chunks)} chunks")
+
+if __name__ == "__main__":
+	main()